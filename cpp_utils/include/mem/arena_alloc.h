@@ -0,0 +1,129 @@
+#ifndef __ARENA_ALLOC_H_
+#define __ARENA_ALLOC_H_
+
+#include <memory_resource>
+
+#include "simple_alloc.h"
+
+/*
+ * Monotonic ( bump ) arena on one SimpleAllocator reservation
+ * Pages are committed in steps as the arena grows, the data never
+ * moves, deallocation is a no-op and reset() frees everything in O(1)
+ * Not thread safe, use one arena per thread, e.g. thread_arena()
+ * */
+template<class BufferAllocator = SimpleAllocator>
+class ArenaAlloc {
+    BufferAllocator buffer;
+    size_t offset = 0;
+    size_t committed;
+    size_t commit_step;
+
+    INLINE_WRAPPER
+    static size_t align_up(size_t v, size_t align) {
+        return (v + align - 1) & ~(align - 1);
+    }
+
+    RARE_FUNC
+    void commit(size_t need) {
+        auto new_size = std::max(need, committed + commit_step);
+        new_size = std::min(new_size, buffer.reserved_bytes());
+        ASSERT_EXC_VOID(need <= new_size, std::bad_alloc);
+        buffer.resize(new_size);
+        committed = buffer.committed_bytes();
+    }
+
+    public:
+
+    // `reserve` is address space only, pages are taken `commit_step` at once
+    ArenaAlloc(size_t reserve = size_t(1) << 30, size_t commit_step = 1 << 20)
+        : buffer(commit_step, reserve),
+          committed(buffer.committed_bytes()),
+          commit_step(commit_step) {
+    }
+
+    ArenaAlloc(const ArenaAlloc &) = delete;
+
+    INLINE_WRAPPER
+    void *allocate(size_t bytes, size_t align = alignof(std::max_align_t)) {
+        auto begin = align_up(offset, align);
+        auto end = begin + bytes;
+        if (unlikely(end > committed)) {
+            commit(end);
+        }
+        offset = end;
+        return (byte*)buffer.get_data() + begin;
+    }
+
+    template<class T>
+    T *allocate_n(size_t n) {
+        return (T*)allocate(n * sizeof(T), alignof(T));
+    }
+
+    /*
+     * Drops every allocation, pages stay committed for reuse
+     * With `keep` set, committed pages past `keep` bytes are returned
+     * */
+    void reset(size_t keep = SIZE_MAX) {
+        offset = 0;
+        if (keep < committed) {
+            buffer.release(keep, committed - keep);
+        }
+    }
+
+    size_t used_bytes() {
+        return offset;
+    }
+
+    size_t committed_bytes() {
+        return committed;
+    }
+
+    size_t reserved_bytes() {
+        return buffer.reserved_bytes();
+    }
+};
+
+/*
+ * std::pmr adapter, STL containers allocate from the arena
+ * and are freed all at once by ArenaAlloc::reset()
+ * */
+template<class Tarena>
+class ArenaResource : public std::pmr::memory_resource {
+    Tarena &arena;
+
+    void *do_allocate(size_t bytes, size_t align) override {
+        return arena.allocate(bytes, align);
+    }
+
+    void do_deallocate(void *, size_t, size_t) override {}
+
+    bool do_is_equal(
+        const std::pmr::memory_resource &other
+    ) const noexcept override {
+        return this == &other;
+    }
+
+    public:
+    ArenaResource(Tarena &arena) : arena(arena) {}
+};
+
+/* Arena with its memory_resource */
+template<class BufferAllocator = SimpleAllocator>
+class PmrArena : public ArenaAlloc<BufferAllocator> {
+    ArenaResource<ArenaAlloc<BufferAllocator>> res{*this};
+
+    public:
+    using ArenaAlloc<BufferAllocator>::ArenaAlloc;
+
+    std::pmr::memory_resource *resource() {
+        return &res;
+    }
+};
+
+/* Per thread arena, lives until the thread exits */
+inline PmrArena<> &thread_arena() {
+    static thread_local PmrArena<> arena;
+    return arena;
+}
+
+#endif /* __ARENA_ALLOC_H_ */
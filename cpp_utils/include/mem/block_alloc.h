@@ -2,15 +2,240 @@
 #define __BLOCK_ALLOC_H_
 
 #include <unordered_map>
-#include <set>
+#include <stdexcept>
+#include <cstring>
+#include <type_traits>
 
+#include "block_alloc_tree.h"
+#include "epoch.h"
+#include "free_index.h"
+#include "futex.h"
 #include "lock_pool.h"
+#include "lock_shared.h"
+#include "periodic_task.h"
 #include "simple_alloc.h"
+#include "thread_pool.h"
+
+/*
+ * Enables BlockAlloc::read() for Obj, specialize to std::true_type
+ * Each slot gets a sequence counter, writers through use() bump it
+ * Obj MUST be trivially copyable
+ * */
+template<class Obj>
+struct block_alloc_optimistic_read : std::false_type {};
+
+/*
+ * Enables SharedRefHolder / WeakRefHolder for Obj, specialize to
+ * std::true_type, each slot gets strong and weak reference counts
+ * */
+template<class Obj>
+struct block_alloc_shared_ref : std::false_type {};
+
+/*
+ * Enables BlockAlloc::for_each() for Obj, specialize to std::true_type
+ * The pool keeps a bitmap of live slots next to the buffer
+ * */
+template<class Obj>
+struct block_alloc_iterable : std::false_type {};
+
+/*
+ * Enables GenRef handles for Obj, specialize to std::true_type
+ * Each slot gets a generation counter, bumped when an object is
+ * created in it and when it is deleted, odd while the slot is live
+ * */
+template<class Obj>
+struct block_alloc_generation : std::false_type {};
+
+/*
+ * Compile-time capacity of BlockAlloc<Obj>, specialize to narrow the
+ * index: idx_t is the smallest of uint16_t / uint32_t / uint64_t that
+ * holds every slot index and a reserved (idx_t)-1, handles shrink with it
+ * The runtime max_capacity is clamped to it
+ * */
+template<class Obj>
+struct block_alloc_capacity : std::integral_constant<uint64_t, UINT32_MAX> {};
+
+/* Capacity of an index type, e.g. block_alloc_capacity_of<uint16_t> */
+template<class Tidx>
+struct block_alloc_capacity_of
+    : std::integral_constant<uint64_t, (Tidx)-1> {};
+
+template<uint64_t capacity>
+using block_alloc_idx_t = std::conditional_t<
+    capacity <= UINT16_MAX, uint16_t,
+    std::conditional_t<capacity <= UINT32_MAX, uint32_t, uint64_t>
+>;
+
+/* Stripes of the object lock pool, fewer for small pools */
+constexpr int block_alloc_stripes(uint64_t capacity) {
+    return capacity >= 16 * 1024 ? 16 : capacity >= 8 * 1024 ? 8 : 4;
+}
+
+/* Lock-free stack while it can pack the index, ordered set beyond */
+template<class Tidx>
+using FreeIndexDefault = std::conditional_t<
+    sizeof(Tidx) <= sizeof(uint32_t), FreeIndexStack<Tidx>, FreeIndexSet<Tidx>
+>;
+
+/* Locking of BlockAlloc::for_each() passes */
+enum class IterLock {
+    // stripe of each object around its visit
+    OBJECT,
+    // stripes of BLOCK_ALLOC_ITER_CHUNK slots at once, fewer lock calls
+    CHUNK,
+    // read-only pass, nobody writes or deletes objects meanwhile
+    NONE
+};
+
+/* Live slot bitmap of iterable pools, no-op otherwise */
+template<bool with_iter>
+struct LiveBits {
+    LiveBits(size_t, size_t) {}
+    void resize(size_t) {}
+    void set(size_t) {}
+    void unset(size_t) {}
+};
+
+template<>
+struct LiveBits<true> : SlotBitmap {
+    using SlotBitmap::SlotBitmap;
+};
+
+/* Optional slot headers, empty ones take no space */
+template<bool with_seq>
+struct SlotSeq {};
+
+template<>
+struct SlotSeq<true> {
+    // odd while the object is being written
+    futex_t seq;
+
+    INLINE_WRAPPER
+    void write_begin() {
+        __atomic_store_n(&seq, seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+
+    INLINE_WRAPPER
+    void write_end() {
+        __atomic_store_n(&seq, seq + 1, __ATOMIC_RELEASE);
+    }
+};
+
+template<bool with_refs>
+struct SlotRefs {};
+
+/*
+ * Strong references keep the object, weak ones keep the slot
+ * All strong references together hold one weak reference
+ * */
+template<>
+struct SlotRefs<true> {
+    uint32_t strong;
+    uint32_t weak;
+
+    INLINE_WRAPPER
+    void init_refs() {
+        strong = 1;
+        weak = 1;
+    }
+
+    INLINE_WRAPPER
+    void strong_acquire() {
+        __atomic_fetch_add(&strong, 1, __ATOMIC_RELAXED);
+    }
+
+    // true if it was the last strong reference
+    INLINE_WRAPPER
+    bool strong_release() {
+        return __atomic_sub_fetch(&strong, 1, __ATOMIC_ACQ_REL) == 0;
+    }
+
+    // fails once the object is gone
+    INLINE_WRAPPER
+    bool strong_upgrade() {
+        auto s = __atomic_load_n(&strong, __ATOMIC_RELAXED);
+        do {
+            if (!s) {
+                return false;
+            }
+        } while (!__atomic_compare_exchange_n(
+            &strong, &s, s + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED
+        ));
+        return true;
+    }
+
+    INLINE_WRAPPER
+    void weak_acquire() {
+        __atomic_fetch_add(&weak, 1, __ATOMIC_RELAXED);
+    }
+
+    // true if the slot can be reused
+    INLINE_WRAPPER
+    bool weak_release() {
+        return __atomic_sub_fetch(&weak, 1, __ATOMIC_ACQ_REL) == 0;
+    }
+};
+
+template<bool with_gen>
+struct SlotGen {
+    INLINE_WRAPPER
+    void gen_bump() {}
+};
+
+template<>
+struct SlotGen<true> {
+    // odd while the slot holds an object, zeroed pages read as free
+    uint32_t gen;
+
+    // slot stripe MUST be held or the slot not reachable yet
+    INLINE_WRAPPER
+    void gen_bump() {
+        __atomic_store_n(&gen, gen + 1, __ATOMIC_RELEASE);
+    }
+};
+
+/*
+ * Object storage, constructed and destroyed by BlockAlloc
+ * A free slot keeps the next free index in place of the object
+ * */
+template<
+    class Obj, class Tidx, bool with_seq, bool with_refs, bool with_gen
+>
+struct BlockSlot : SlotSeq<with_seq>, SlotRefs<with_refs>, SlotGen<with_gen> {
+    union {
+        alignas(Obj) byte data[sizeof(Obj)];
+        Tidx next_free;
+    };
+
+    INLINE_WRAPPER
+    Obj *obj() {
+        return (Obj*)data;
+    }
+
+    // lock-free snapshot, retries while a writer is active
+    Obj read() {
+        static_assert(with_seq, "Optimistic read is not enabled for Obj");
+        alignas(Obj) byte r[sizeof(Obj)];
+        while (true) {
+            auto s1 = __atomic_load_n(&this->seq, __ATOMIC_ACQUIRE);
+            if (unlikely(s1 & 1)) {
+                cpu_relax();
+                continue;
+            }
+            memcpy(r, data, sizeof(Obj));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (likely(__atomic_load_n(&this->seq, __ATOMIC_RELAXED) == s1)) {
+                return *(Obj*)r;
+            }
+        }
+    }
+};
 
 template<class Obj, class Tl>
 class UseHolder {
-    Obj &o;
     decltype(((Tl*)NULL)->lock()) l;
+    Obj &o;
 
     INLINE_WRAPPER
     operator Obj&() {
@@ -23,16 +248,91 @@ class UseHolder {
         return o;
     }
 
+    // get() runs with the stripe held, the buffer may move before that
+    template<class Tget>
     INLINE_WRAPPER
-    UseHolder(Obj &o, Tl &lock)
-        : o(o), l(lock.lock()) {}
+    UseHolder(Tl &lock, Tget &&get)
+        : l(lock.lock()), o(get()) {}
+};
+
+/* Write access through a GenRef, empty when the handle went stale */
+template<class Obj, class Tl>
+class GenUseHolder {
+    Obj *o;
+    Tl *l;
+
+    public:
+    // `l` is held already, NULL if stale
+    INLINE_WRAPPER
+    GenUseHolder(Obj *o, Tl *l) : o(o), l(l) {}
+
+    GenUseHolder(const GenUseHolder &) = delete;
+
+    INLINE_WRAPPER
+    explicit operator bool() {
+        return o;
+    }
+
+    INLINE_WRAPPER
+    Obj &obj() {
+        return *o;
+    }
+
+    INLINE_WRAPPER
+    ~GenUseHolder() {
+        if (l) {
+            l->unlock_c();
+        }
+    }
+};
+
+/* Write access for optimistic read objects, slot sequence is odd meanwhile */
+template<class Obj, class Tl, class Tslot>
+class SeqUseHolder {
+    Tslot &s;
+    decltype(((Tl*)NULL)->lock()) l;
+
+    public:
+    INLINE_WRAPPER
+    Obj &obj() {
+        return *s.obj();
+    }
+
+    INLINE_WRAPPER
+    SeqUseHolder(Tslot &s, Tl &lock)
+        : s(s), l(lock.lock()) {
+        s.write_begin();
+    }
+
+    INLINE_WRAPPER
+    ~SeqUseHolder() {
+        s.write_end();
+    }
+};
+
+/* Read-only access, holds the shared side of the object lock */
+template<class Obj, class Tl>
+class SharedUseHolder {
+    decltype(((Tl*)NULL)->lock_shared()) l;
+    const Obj &o;
+
+    public:
+    INLINE_WRAPPER
+    const Obj &obj() {
+        return o;
+    }
+
+    template<class Tget>
+    INLINE_WRAPPER
+    SharedUseHolder(Tl &lock, Tget &&get)
+        : l(lock.lock_shared()), o(get()) {}
 };
 
 #pragma pack(push, 1)
 /* Single-owner reference holder */
 template<class Obj>
 class SingleOwnerRefHolder {
-    using idx_t = decltype(Obj::allocator.idx_type_obj);
+    using idx_t = std::remove_const_t<decltype(Obj::allocator.idx_type_obj)>;
 
     idx_t id;
 
@@ -46,132 +346,1037 @@ class SingleOwnerRefHolder {
         return Obj::allocator.use(id);
     }
 
+    INLINE_WRAPPER
+    auto use_shared() {
+        return Obj::allocator.use_shared(id);
+    }
+
+    INLINE_WRAPPER
+    auto read() {
+        return Obj::allocator.read(id);
+    }
+
+    INLINE_WRAPPER
+    idx_t index() {
+        return id;
+    }
+
+    // moves object closer to the front if there is a free slot
+    INLINE_WRAPPER
+    void reposition() {
+        id = Obj::allocator.reposition(id);
+    }
+
+    // non-owning handle that detects the object is gone, see GenRef
+    template<class Tpacked = uint64_t>
+    INLINE_WRAPPER
+    auto gen_ref() {
+        return Obj::allocator.template gen_ref<Tpacked>(id);
+    }
+
     INLINE_WRAPPER
     ~SingleOwnerRefHolder() {
         Obj::allocator.delete_(id);
     }
 };
+
+template<class Obj>
+class WeakRefHolder;
+
+/*
+ * Multi-owner reference, see block_alloc_shared_ref
+ * Copy bumps the strong count in the slot, move is free,
+ * the object is deleted with the last strong reference
+ * */
+template<class Obj>
+class SharedRefHolder {
+    using idx_t = std::remove_const_t<decltype(Obj::allocator.idx_type_obj)>;
+    constexpr static idx_t NIL = (idx_t)-1;
+
+    friend class WeakRefHolder<Obj>;
+
+    idx_t id = NIL;
+
+    INLINE_WRAPPER
+    void clear() {
+        if (id != NIL) {
+            Obj::allocator.ref_release(id);
+            id = NIL;
+        }
+    }
+
+    public:
+
+    // takes over a reference already counted in the slot
+    INLINE_WRAPPER
+    explicit SharedRefHolder(idx_t id) : id(id) {}
+
+    SharedRefHolder() = default;
+
+    INLINE_WRAPPER
+    SharedRefHolder(const SharedRefHolder &r) : id(r.id) {
+        if (id != NIL) {
+            Obj::allocator.ref_acquire(id);
+        }
+    }
+
+    INLINE_WRAPPER
+    SharedRefHolder(SharedRefHolder &&r) : id(r.id) {
+        r.id = NIL;
+    }
+
+    SharedRefHolder &operator=(const SharedRefHolder &r) {
+        if (this != &r) {
+            clear();
+            id = r.id;
+            if (id != NIL) {
+                Obj::allocator.ref_acquire(id);
+            }
+        }
+        return *this;
+    }
+
+    SharedRefHolder &operator=(SharedRefHolder &&r) {
+        if (this != &r) {
+            clear();
+            id = r.id;
+            r.id = NIL;
+        }
+        return *this;
+    }
+
+    INLINE_WRAPPER
+    explicit operator bool() const {
+        return id != NIL;
+    }
+
+    INLINE_WRAPPER
+    auto use() {
+        return Obj::allocator.use(id);
+    }
+
+    INLINE_WRAPPER
+    auto use_shared() {
+        return Obj::allocator.use_shared(id);
+    }
+
+    INLINE_WRAPPER
+    auto read() {
+        return Obj::allocator.read(id);
+    }
+
+    INLINE_WRAPPER
+    idx_t index() {
+        return id;
+    }
+
+    INLINE_WRAPPER
+    ~SharedRefHolder() {
+        clear();
+    }
+};
+
+/* Keeps the slot but not the object, lock() upgrades to SharedRefHolder */
+template<class Obj>
+class WeakRefHolder {
+    using idx_t = std::remove_const_t<decltype(Obj::allocator.idx_type_obj)>;
+    constexpr static idx_t NIL = (idx_t)-1;
+
+    idx_t id = NIL;
+
+    INLINE_WRAPPER
+    void clear() {
+        if (id != NIL) {
+            Obj::allocator.weak_release(id);
+            id = NIL;
+        }
+    }
+
+    public:
+
+    WeakRefHolder() = default;
+
+    INLINE_WRAPPER
+    WeakRefHolder(const SharedRefHolder<Obj> &r) : id(r.id) {
+        if (id != NIL) {
+            Obj::allocator.weak_acquire(id);
+        }
+    }
+
+    INLINE_WRAPPER
+    WeakRefHolder(const WeakRefHolder &r) : id(r.id) {
+        if (id != NIL) {
+            Obj::allocator.weak_acquire(id);
+        }
+    }
+
+    INLINE_WRAPPER
+    WeakRefHolder(WeakRefHolder &&r) : id(r.id) {
+        r.id = NIL;
+    }
+
+    WeakRefHolder &operator=(WeakRefHolder r) {
+        std::swap(id, r.id);
+        return *this;
+    }
+
+    // empty holder if the object is already deleted
+    INLINE_WRAPPER
+    SharedRefHolder<Obj> lock() {
+        if (id != NIL && Obj::allocator.ref_upgrade(id)) {
+            return SharedRefHolder<Obj>(id);
+        }
+        return SharedRefHolder<Obj>();
+    }
+
+    INLINE_WRAPPER
+    bool expired() {
+        return id == NIL || !Obj::allocator.ref_alive(id);
+    }
+
+    INLINE_WRAPPER
+    ~WeakRefHolder() {
+        clear();
+    }
+};
 /*
- * TODO: multi-owner reference
+ * Non-owning handle tagged with the slot generation, see
+ * block_alloc_generation. valid() is one lock-free load, try_use()
+ * locks the object only if it is still there. Stale handles are safe
+ * to keep, e.g. in caches, and are dropped when found invalid
+ * uint64_t packs a 32 bit index with a 32 bit generation, uint32_t
+ * a 24 bit index ( max_capacity <= 2^24 ) with an 8 bit one
+ * Generations wrap, a handle outliving 2^(bits - 1) reuses of its
+ * slot may see a new object, repositioned objects get new handles
  * */
+template<class Obj, class Tpacked = uint64_t>
+class GenRef {
+    using idx_t = std::remove_const_t<decltype(Obj::allocator.idx_type_obj)>;
+
+    static_assert(
+        std::is_same<Tpacked, uint64_t>::value
+        || std::is_same<Tpacked, uint32_t>::value,
+        "GenRef packs into uint64_t or uint32_t"
+    );
+
+    public:
+        constexpr static int IDX_BITS = sizeof(Tpacked) == 8 ? 32 : 24;
+        constexpr static Tpacked IDX_MASK = ((Tpacked)1 << IDX_BITS) - 1;
+        constexpr static uint32_t GEN_MASK = (Tpacked)-1 >> IDX_BITS;
+
+    private:
+    // generation 0 is never live, default handles are invalid
+    Tpacked v = 0;
+
+    public:
+    GenRef() = default;
+
+    INLINE_WRAPPER
+    GenRef(idx_t i, uint32_t gen)
+        : v(((Tpacked)(gen & GEN_MASK) << IDX_BITS) | i) {}
+
+    INLINE_WRAPPER
+    idx_t index() const {
+        return v & IDX_MASK;
+    }
+
+    INLINE_WRAPPER
+    uint32_t gen() const {
+        return v >> IDX_BITS;
+    }
+
+    INLINE_WRAPPER
+    Tpacked packed() const {
+        return v;
+    }
+
+    INLINE_WRAPPER
+    bool operator==(const GenRef &r) const {
+        return v == r.v;
+    }
+
+    // the object may be deleted right after, use try_use() to act on it
+    INLINE_WRAPPER
+    bool valid() const {
+        return Obj::allocator.gen_valid(*this);
+    }
+
+    INLINE_WRAPPER
+    auto try_use() const {
+        return Obj::allocator.try_use(*this);
+    }
+};
+
 #pragma pack(pop)
 
-template<class Obj, class BufferAllocator = SimpleAllocator>
+/* Default hard cap of a BlockAlloc, in objects */
+#define BLOCK_ALLOC_MAX_CAPACITY (1u << 24)
+/* Free tail size that makes delete_() return pages to the kernel */
+#define BLOCK_ALLOC_RELEASE_MIN (1u << 20)
+/* Slots locked at once by IterLock::CHUNK passes */
+#define BLOCK_ALLOC_ITER_CHUNK 1024
+/* Slots per task of parallel_for_each() */
+#define BLOCK_ALLOC_PARALLEL_CHUNK (1u << 16)
+
+/*
+ * Used size and capacity of a pool of slots, see BlockAlloc
+ * grow() hands out never used slots lock-free, reserve() makes them
+ * accessible. Tslots adapts the pool buffers:
+ *   template<bool can_move> void resize(size_t n) - slots below n
+ *   auto lock_all()                               - every object stripe
+ * Growth takes grow_lock only, never the allocator lock. Buffers
+ * without a reservation ( can_move ) may be moved by mremap with every
+ * object stripe held as well: their pools MUST touch slots only under
+ * the object stripe and call reserve() with no allocator lock or
+ * stripe held
+ * */
+template<class Tidx>
+class SlotCapacity {
+    LockObject grow_lock;
+
+    template<bool can_move, class Tslots>
+    RARE_FUNC
+    void grow_capacity(size_t need, Tslots &slots) {
+        auto l = grow_lock.lock();
+        auto cap = capacity;
+        if (need <= cap) {
+            return;
+        }
+        auto new_cap = (Tidx)std::min<size_t>(
+            std::max<size_t>(need, (size_t)cap * 2), max_capacity
+        );
+        if constexpr (can_move) {
+            try {
+                slots.template resize<false>(new_cap);
+            } catch (std::bad_alloc &) {
+                auto lo = slots.lock_all();
+                slots.template resize<true>(new_cap);
+            }
+        } else {
+            slots.template resize<false>(new_cap);
+        }
+        __atomic_store_n(&capacity, new_cap, __ATOMIC_RELEASE);
+    }
+
+    public:
+    Tidx size = 0;
+    Tidx capacity;
+    Tidx max_capacity;
+
+    // both are clamped to `limit`
+    SlotCapacity(size_t capacity, size_t max_capacity, uint64_t limit)
+        : capacity(std::min<uint64_t>(capacity, limit)),
+          max_capacity(std::min<uint64_t>(
+              std::max(capacity, max_capacity), limit
+          )) {
+    }
+
+    // takes n never used slots, throws std::length_error past max_capacity
+    INLINE_WRAPPER
+    Tidx grow(Tidx n) {
+        auto s = __atomic_load_n(&size, __ATOMIC_RELAXED);
+        do {
+            if (unlikely((size_t)s + n > max_capacity)) {
+                auto max_capacity = this->max_capacity;
+                THROW(std::length_error,
+                    "Pool is full, max capacity", max_capacity
+                );
+            }
+        } while (!__atomic_compare_exchange_n(
+            &size, &s, s + n, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED
+        ));
+        return s;
+    }
+
+    // makes slots below `need` accessible
+    template<bool can_move, class Tslots>
+    INLINE_WRAPPER
+    void reserve(size_t need, Tslots &slots) {
+        if (unlikely(need > __atomic_load_n(&capacity, __ATOMIC_ACQUIRE))) {
+            grow_capacity<can_move>(need, slots);
+        }
+    }
+
+    // f() if no growth is running, for buffer access outside the stripes
+    template<class Tf>
+    bool try_exclusive(Tf &&f) {
+        if (!grow_lock.try_lock_c()) {
+            return false;
+        }
+        f();
+        grow_lock.unlock_c();
+        return true;
+    }
+};
+
+/*
+ * Pool of Obj slots addressed by index
+ * Capacity starts small and doubles up to max_capacity, growing past
+ * it throws std::length_error. SimpleAllocator reserves address space
+ * for max_capacity, so growth never moves objects. Buffers without
+ * a reservation ( e.g. SecureAllocator ) are moved by mremap with all
+ * object stripes held, see SlotCapacity: they need a locking free index,
+ * rule out lock-free slot traits, and peek() or IterLock::NONE passes
+ * MUST NOT run while the pool grows. Objects of such pools MUST NOT be
+ * held across emplace()
+ * Pools with a trimming free index ( FreeIndexSet, FreeIndexTree )
+ * return pages behind the trimmed tail to the kernel, see release_free()
+ * Lock-free indices ( the default FreeIndexStack ) keep every page,
+ * the release calls do not compile for them
+ * */
+template<
+    class Obj, class BufferAllocator = SimpleAllocator,
+    class ObjLock = LockObject,
+    template<class> class FreeIndex = FreeIndexDefault
+>
 class BlockAlloc : public LockObject {
     public:
-        using idx_t = unsigned int;
+        constexpr static uint64_t CAPACITY = block_alloc_capacity<Obj>::value;
+        using idx_t = block_alloc_idx_t<CAPACITY>;
         constexpr static idx_t idx_type_obj = 0;
 
     private:
 
-    idx_t size = 0;
-    std::set<idx_t, std::greater<idx_t>> free_blocks;
+    constexpr static bool with_seq = block_alloc_optimistic_read<Obj>::value;
+    constexpr static bool with_refs = block_alloc_shared_ref<Obj>::value;
+    constexpr static bool with_iter = block_alloc_iterable<Obj>::value;
+    constexpr static bool with_gen = block_alloc_generation<Obj>::value;
+    using slot_t = BlockSlot<Obj, idx_t, with_seq, with_refs, with_gen>;
+
+    // no address space reservation, growth may move the buffer
+    constexpr static bool can_move =
+        !std::is_constructible<BufferAllocator, size_t, size_t>::value;
+
+    static_assert(
+        !can_move || FreeIndex<idx_t>::needs_lock,
+        "Buffers without a reservation need a locking free index"
+    );
+    static_assert(
+        !can_move || !(with_seq || with_refs || with_gen),
+        "Lock-free slot access needs a buffer with a reservation"
+    );
+
+    static_assert(
+        !with_seq || std::is_trivially_copyable<Obj>::value,
+        "Optimistic read needs trivially copyable objects"
+    );
 
-    PoolLock<idx_t, 16> lock_pool;
+    SlotCapacity<idx_t> cap;
+    FreeIndex<idx_t> free_index;
+
+    PoolLock<idx_t, block_alloc_stripes(CAPACITY), ObjLock> lock_pool;
 
     BufferAllocator buffer;
+    LiveBits<with_iter> live_bits;
+
+    // slots touched since the last page release, allocator lock
+    idx_t dirty = 0;
+    size_t release_min_bytes = BLOCK_ALLOC_RELEASE_MIN;
+    bool release_lazy = false;
+    PeriodicTask trimmer;
+
+    static size_t calc_size(size_t size) {
+        return (size_t)size * sizeof(slot_t);
+    }
 
-    // TODO: align ?
-    auto calc_size(idx_t size) {
-        return size * sizeof(Obj);
+    static BufferAllocator make_buffer(size_t capacity, size_t max_capacity) {
+        if constexpr (
+            std::is_constructible<BufferAllocator, size_t, size_t>::value
+        ) {
+            return BufferAllocator(calc_size(capacity), calc_size(max_capacity));
+        } else {
+            return BufferAllocator(calc_size(capacity));
+        }
     }
 
     INLINE_WRAPPER
-    Obj *buf_ptr() {
-        return (Obj*)buffer.get_data();
+    slot_t *buf_ptr() {
+        return (slot_t*)buffer.get_data();
     }
 
-    void reduce_free() {
-        auto it = free_blocks.begin();
-        while (it != free_blocks.end() && *it == size-1) {
-            it = free_blocks.erase(it);
-            size --;
+    INLINE_WRAPPER
+    Obj *obj_ptr(idx_t i) {
+        return buf_ptr()[i].obj();
+    }
+
+    // slot array access for the free index
+    struct Slots {
+        BlockAlloc &a;
+
+        INLINE_WRAPPER
+        idx_t &link(idx_t i) {
+            return a.buf_ptr()[i].next_free;
+        }
+
+        // buffers that may move grow once the allocator lock is released
+        INLINE_WRAPPER
+        idx_t grow(idx_t n) {
+            auto s = a.cap.grow(n);
+            if constexpr (!can_move) {
+                a.reserve((size_t)s + n);
+            }
+            if constexpr (FreeIndex<idx_t>::needs_lock) {
+                a.dirty = std::max(a.dirty, (idx_t)(s + n));
+            }
+            return s;
+        }
+
+        template<bool can_move>
+        void resize(size_t n) {
+            a.buffer.template resize<can_move>(calc_size(n));
+            a.live_bits.resize(n);
+        }
+
+        auto lock_all() {
+            return a.lock_pool.lock_all();
+        }
+    } slots{*this};
+
+    // allocator lock MUST NOT be held if the buffer can move
+    INLINE_WRAPPER
+    void reserve(size_t need) {
+        cap.template reserve<can_move>(need, slots);
+    }
+
+    // runs f() under the allocator lock if the free index needs it
+    template<class Tf>
+    INLINE_WRAPPER
+    auto with_free_index(Tf &&f) {
+        return with_free_index_lock<FreeIndex<idx_t>>(*this, f);
+    }
+
+    // bumps slot sequence around f(), no other writer may touch slot i
+    template<class Tf>
+    INLINE_WRAPPER
+    void write_slot(idx_t i, Tf &&f) {
+        if constexpr (with_seq) {
+            buf_ptr()[i].write_begin();
+            f();
+            buf_ptr()[i].write_end();
+        } else {
+            f();
         }
     }
 
     bool should_reposition(idx_t i) {
-        if (free_blocks.empty()) {
+        auto n_free = free_index.count();
+        if (!n_free) {
             return false;
         }
-        return i >= size - free_blocks.size();
+        return i >= __atomic_load_n(&cap.size, __ATOMIC_RELAXED) - n_free;
     }
 
-    auto reposition_obj(idx_t i) {
-        auto new_pos_it = free_blocks.rbegin();
-        if (new_pos_it == free_blocks.rend()) {
-            return i;
-        }
-        auto new_pos = *new_pos_it;
-        if (new_pos > i) {
-            return i;
+    // both object stripes MUST be locked
+    void reposition_obj(idx_t i, idx_t new_pos) {
+        write_slot(new_pos, [&]() {
+            new (obj_ptr(new_pos)) Obj(std::move(*obj_ptr(i)));
+        });
+        buf_ptr()[new_pos].gen_bump();
+        live_bits.set(new_pos);
+        live_bits.unset(i);
+        buf_ptr()[i].gen_bump();
+        write_slot(i, [&]() {
+            obj_ptr(i)->~Obj();
+        });
+    }
+
+    // object stripe MUST be locked
+    void delete_obj(idx_t i) {
+        live_bits.unset(i);
+        buf_ptr()[i].gen_bump();
+        write_slot(i, [&]() {
+            obj_ptr(i)->~Obj();
+        });
+    }
+
+    // under the allocator lock if the free index needs it
+    void trim_free() {
+        free_index.trim(cap.size);
+        if constexpr (FreeIndex<idx_t>::needs_lock) {
+            if (unlikely(release_min_bytes
+                && calc_size(dirty - cap.size) >= release_min_bytes * 2
+            )) {
+                release_tail(release_min_bytes);
+            }
         }
+    }
 
-        buf_ptr()[new_pos] = std::move(buf_ptr()[i]);
+    void free_slot(idx_t i) {
+        with_free_index([&]() {
+            free_index.push(i, slots);
+            trim_free();
+        });
+    }
+
+    void free_slots(const idx_t *ids, int n) {
+        with_free_index([&]() {
+            free_index.push_many(ids, n, slots);
+            trim_free();
+        });
+    }
+
+    /*
+     * Releases pages behind the trimmed tail, allocator lock MUST be held
+     * A quarter of the live size is kept as headroom against regrowth
+     * */
+    RARE_FUNC
+    size_t release_tail(size_t min_bytes) {
+        auto keep = (size_t)cap.size + cap.size / 4;
+        if (keep >= dirty) {
+            return 0;
+        }
+        auto bytes = calc_size(dirty) - calc_size(keep);
+        if (bytes < min_bytes) {
+            return 0;
+        }
+        auto release = [&]() {
+            buffer.release(calc_size(keep), bytes, release_lazy);
+        };
+        if constexpr (can_move) {
+            // retried on a later delete_() if the buffer is being moved
+            if (!cap.try_exclusive(release)) {
+                return 0;
+            }
+        } else {
+            release();
+        }
+        dirty = keep;
+        return bytes;
+    }
 
-        free_blocks.erase(-- new_pos_it.base());
-        free_blocks.insert(i);
-        reduce_free();
+    idx_t alloc_slot() {
+        auto new_pos = with_free_index([&]() {
+            idx_t new_pos;
+            if (!free_index.pop(new_pos, slots)) {
+                new_pos = slots.grow(1);
+            }
+            return new_pos;
+        });
+        reserve((size_t)new_pos + 1);
         return new_pos;
     }
 
-    void delete_obj(idx_t i) {
-        auto deleted_ptr = buf_ptr() + i;
-        deleted_ptr->~Obj();
+    // free slots first, the rest are taken as one contiguous run
+    void alloc_slots(idx_t *out, int n) {
+        with_free_index([&]() {
+            int k = free_index.pop_many(out, n, slots);
+            // indices that grow the pool themselves
+            while (k < n && free_index.pop(out[k], slots)) {
+                k++;
+            }
+            if (k < n) {
+                auto first = slots.grow(n - k);
+                for (idx_t j = 0; k < n; j++) {
+                    out[k++] = first + j;
+                }
+            }
+        });
+        if (n) {
+            reserve((size_t)*std::max_element(out, out + n) + 1);
+        }
+    }
 
-        free_blocks.insert(i);
+    // the slot is not reachable by anyone else yet
+    template<class ... Targs>
+    void construct_obj(idx_t i, Targs& ...constructor_args) {
+        auto construct = [&]() {
+            write_slot(i, [&]() {
+                new (obj_ptr(i)) Obj(constructor_args...);
+            });
+            buf_ptr()[i].gen_bump();
+            live_bits.set(i);
+        };
+        if constexpr (can_move) {
+            // keeps the buffer in place
+            auto lo = lock_pool.lock(i);
+            construct();
+        } else {
+            construct();
+        }
     }
 
     template<class ... Targs>
     idx_t emplace_obj(Targs& ...constructor_args) {
-        auto new_pos_it = free_blocks.rbegin();
-        if (new_pos_it == free_blocks.rend()) {
-            auto new_pos = size ++; // TODO: check size left
-            new (buf_ptr() + new_pos) Obj(constructor_args...);
+        auto new_pos = alloc_slot();
+        construct_obj(new_pos, constructor_args...);
+        return new_pos;
+    }
 
-            return new_pos;
-        } else {
-            auto new_pos = *new_pos_it;
-            new (buf_ptr() + new_pos) Obj(constructor_args...);
-            free_blocks.erase(-- new_pos_it.base());
+    // live slots of bitmap word w inside [begin, end)
+    INLINE_WRAPPER
+    bit_word_t live_word(size_t w, idx_t begin, idx_t end) {
+        auto bits = live_bits.word(w);
+        size_t lo = w << BIT_WORD_SHIFT;
+        if (begin > lo) {
+            bits &= ~(bit_word_t)0 << (begin - lo);
+        }
+        if (end < lo + BIT_WORD_BITS) {
+            bits &= (word_bit(end - lo)) - 1;
+        }
+        return bits;
+    }
 
-            return new_pos;
+    template<class Tf>
+    INLINE_WRAPPER
+    void visit(idx_t i, Tf &f) {
+        write_slot(i, [&]() {
+            f(i, *obj_ptr(i));
+        });
+    }
+
+    template<IterLock mode, class Tf>
+    void visit_range(idx_t begin, idx_t end, Tf &f) {
+        static_assert(with_iter, "Iteration is not enabled for Obj");
+        constexpr size_t CHUNK_WORDS = BLOCK_ALLOC_ITER_CHUNK / BIT_WORD_BITS;
+
+        size_t w = begin >> BIT_WORD_SHIFT;
+        while ((w << BIT_WORD_SHIFT) < end) {
+            if constexpr (mode == IterLock::CHUNK) {
+                idx_t ids[BLOCK_ALLOC_ITER_CHUNK];
+                int n = 0;
+                for (auto w_end = w + CHUNK_WORDS;
+                        w < w_end && (w << BIT_WORD_SHIFT) < end; w++) {
+                    auto bits = live_word(w, begin, end);
+                    while (bits) {
+                        ids[n++] = (w << BIT_WORD_SHIFT) | word_first_set(bits);
+                        bits &= bits - 1;
+                    }
+                }
+                if (!n) {
+                    continue;
+                }
+                auto lo = lock_pool.lock_range(ids, ids + n);
+                for (int k = 0; k < n; k++) {
+                    // deleted before we got the stripes
+                    if (likely(live_bits.test(ids[k]))) {
+                        visit(ids[k], f);
+                    }
+                }
+            } else {
+                auto bits = live_word(w, begin, end);
+                while (bits) {
+                    idx_t i = (w << BIT_WORD_SHIFT) | word_first_set(bits);
+                    bits &= bits - 1;
+                    if constexpr (mode == IterLock::OBJECT) {
+                        auto lo = lock_pool.lock(i);
+                        if (likely(live_bits.test(i))) {
+                            visit(i, f);
+                        }
+                    } else {
+                        f(i, *obj_ptr(i));
+                    }
+                }
+                w++;
+            }
         }
     }
 
     public:
 
-    BlockAlloc(idx_t size=16)
-        : size(size), buffer() {
+    BlockAlloc(
+        size_t capacity = 16, size_t max_capacity = BLOCK_ALLOC_MAX_CAPACITY
+    )
+        : cap(capacity, max_capacity, CAPACITY),
+          buffer(make_buffer(cap.capacity, cap.max_capacity)),
+          live_bits(cap.capacity, cap.max_capacity) {
+    }
+
+    // address space taken by the pool
+    size_t reserved_bytes() {
+        return buffer.reserved_bytes();
+    }
+
+    // accessible part of the pool
+    size_t committed_bytes() {
+        return buffer.committed_bytes();
+    }
+
+    idx_t get_capacity() {
+        return __atomic_load_n(&cap.capacity, __ATOMIC_ACQUIRE);
+    }
+
+    /*
+     * delete_() releases the free tail once it exceeds 2 * min_bytes,
+     * the gap keeps alloc / free near the boundary from flapping
+     * 0 disables it, lazy uses MADV_FREE ( RSS drops only under pressure )
+     * */
+    void set_release_policy(size_t min_bytes, bool lazy = false) {
+        static_assert(FreeIndex<idx_t>::needs_lock,
+            "Lock-free free indices never trim, use FreeIndexSet / Tree"
+        );
+        auto l = lock();
+        release_min_bytes = min_bytes;
+        release_lazy = lazy;
+    }
+
+    // returns free tail pages to the kernel now
+    size_t release_free() {
+        static_assert(FreeIndex<idx_t>::needs_lock,
+            "Lock-free free indices never trim, use FreeIndexSet / Tree"
+        );
+        auto l = lock();
+        return release_tail(0);
+    }
+
+    // calls release_free() every `period` from a background thread
+    void start_trimmer(
+        std::chrono::milliseconds period = std::chrono::milliseconds(1000)
+    ) {
+        static_assert(FreeIndex<idx_t>::needs_lock,
+            "Lock-free free indices never trim, use FreeIndexSet / Tree"
+        );
+        trimmer.start(period, [this]() {
+            release_free();
+            return false;
+        });
+    }
+
+    void stop_trimmer() {
+        trimmer.stop();
+    }
+
+    void set_lock_name(const std::string &name) {
+        LockObject::set_lock_name(name);
+        lock_pool.set_lock_name(name + ".obj");
     }
 
     template<class ... Targs>
     auto emplace(Targs& ...constructor_args) {
-        auto l = lock();
         return SingleOwnerRefHolder<Obj>(
             emplace_obj(constructor_args...)
         );
     }
 
     void delete_(idx_t i) {
-        auto l = lock();
-        auto lo = lock_pool.lock(i);
-        delete_obj(i);
+        { // scope for lock
+            auto lo = lock_pool.lock(i);
+            delete_obj(i);
+        }
+        free_slot(i);
+    }
+
+    /*
+     * Batched emplace() / delete_() / use(), one allocator lock round
+     * and each needed stripe taken once per call
+     * Objects are owned by index, not by SingleOwnerRefHolder, ids MUST
+     * be distinct
+     * */
+    template<class ... Targs>
+    void emplace_many(idx_t *out, int n, Targs& ...constructor_args) {
+        alloc_slots(out, n);
+        for (int k = 0; k < n; k++) {
+            construct_obj(out[k], constructor_args...);
+        }
+    }
+
+    void delete_many(const idx_t *ids, int n) {
+        { // scope for lock
+            auto lo = lock_pool.lock_range(ids, ids + n);
+            for (int k = 0; k < n; k++) {
+                delete_obj(ids[k]);
+            }
+        }
+        free_slots(ids, n);
+    }
+
+    // calls f(idx, obj) for ids[0..n) with all their stripes held
+    template<class Tf>
+    void use_many(const idx_t *ids, int n, Tf &&f) {
+        auto lo = lock_pool.lock_range(ids, ids + n);
+        for (int k = 0; k < n; k++) {
+            auto i = ids[k];
+            write_slot(i, [&]() {
+                f(i, *obj_ptr(i));
+            });
+        }
     }
 
-    auto reposition(idx_t i) {
+    /*
+     * Deletes object i once no reader pinned in `d` can see it,
+     * see mem/epoch.h. Readers use peek() inside d.pin()
+     * */
+    void delete_deferred(idx_t i, EpochDomain &d = default_epoch_domain()) {
+        d.retire([](void *a, uint64_t i) {
+            ((BlockAlloc*)a)->delete_((idx_t)i);
+        }, this, i);
+    }
+
+    /*
+     * Lock-free access for readers pinned in the epoch domain that
+     * deletes of this object are deferred to, writers through use() are
+     * not excluded and MUST keep the object readable. Objects read this
+     * way MUST NOT be repositioned
+     * */
+    INLINE_WRAPPER
+    const Obj &peek(idx_t i) {
+        return *obj_ptr(i);
+    }
+
+    // moves object i to a lower free slot, returns its new index
+    idx_t reposition(idx_t i) {
         if (!should_reposition(i)) {
             return i;
         }
-        auto l = lock();
-        auto lo = lock_pool.lock(i);
-        return reposition_obj(i);
+        idx_t new_pos;
+        if (!with_free_index([&]() {
+            return free_index.pop_below(i, new_pos, slots);
+        })) {
+            return i;
+        }
+        { // scope for lock
+            auto lo = lock_pool.lock_many(i, new_pos);
+            reposition_obj(i, new_pos);
+        }
+        free_slot(i);
+        return new_pos;
+    }
+
+    // locks objects for cross-object operations, safe for any key order
+    template<class ... Tidx>
+    auto lock_objs(Tidx ...ids) {
+        return lock_pool.lock_many(((idx_t)ids)...);
     }
 
     auto use(idx_t i) {
-        return UseHolder(
-            buf_ptr()[i], lock_pool.get_locker(i)
+        if constexpr (with_seq) {
+            return SeqUseHolder<Obj, ObjLock, slot_t>(
+                buf_ptr()[i], lock_pool.get_locker(i)
+            );
+        } else {
+            return UseHolder<Obj, ObjLock>(
+                lock_pool.get_locker(i), [&]() -> Obj& {
+                    return *obj_ptr(i);
+                }
+            );
+        }
+    }
+
+    // ObjLock MUST provide lock_shared(), e.g. SharedLockObject
+    auto use_shared(idx_t i) {
+        return SharedUseHolder<Obj, ObjLock>(
+            lock_pool.get_locker(i), [&]() -> const Obj& {
+                return *obj_ptr(i);
+            }
         );
     }
+
+    /*
+     * Multi-owner references, see block_alloc_shared_ref
+     * Counts live in the slot, handles call these on copy / drop
+     * */
+    template<class ... Targs>
+    auto emplace_shared(Targs& ...constructor_args) {
+        static_assert(with_refs, "Shared references are not enabled for Obj");
+        auto i = emplace_obj(constructor_args...);
+        buf_ptr()[i].init_refs();
+        return SharedRefHolder<Obj>(i);
+    }
+
+    INLINE_WRAPPER
+    void ref_acquire(idx_t i) {
+        buf_ptr()[i].strong_acquire();
+    }
+
+    void ref_release(idx_t i) {
+        if (buf_ptr()[i].strong_release()) {
+            { // scope for lock
+                auto lo = lock_pool.lock(i);
+                delete_obj(i);
+            }
+            weak_release(i);
+        }
+    }
+
+    INLINE_WRAPPER
+    bool ref_upgrade(idx_t i) {
+        return buf_ptr()[i].strong_upgrade();
+    }
+
+    INLINE_WRAPPER
+    bool ref_alive(idx_t i) {
+        return __atomic_load_n(&buf_ptr()[i].strong, __ATOMIC_RELAXED);
+    }
+
+    INLINE_WRAPPER
+    void weak_acquire(idx_t i) {
+        buf_ptr()[i].weak_acquire();
+    }
+
+    void weak_release(idx_t i) {
+        if (buf_ptr()[i].weak_release()) {
+            free_slot(i);
+        }
+    }
+
+    /*
+     * Calls f(idx, obj) for every live object in [begin, end), see IterLock
+     * and block_alloc_iterable. Objects created or repositioned during the
+     * pass may be skipped or visited twice
+     * */
+    template<IterLock mode = IterLock::OBJECT, class Tf>
+    void for_each_range(idx_t begin, idx_t end, Tf &&f) {
+        end = std::min(end, __atomic_load_n(&cap.size, __ATOMIC_ACQUIRE));
+        visit_range<mode>(begin, end, f);
+    }
+
+    template<IterLock mode = IterLock::OBJECT, class Tf>
+    void for_each(Tf &&f) {
+        auto n = __atomic_load_n(&cap.size, __ATOMIC_ACQUIRE);
+        for_each_range<mode>(0, n, f);
+    }
+
+    // for_each() split into BLOCK_ALLOC_PARALLEL_CHUNK slot ranges on `pool`
+    template<IterLock mode = IterLock::OBJECT, class Tf>
+    void parallel_for_each(ThreadPool &pool, Tf &&f) {
+        auto n = __atomic_load_n(&cap.size, __ATOMIC_ACQUIRE);
+        constexpr size_t CHUNK = BLOCK_ALLOC_PARALLEL_CHUNK;
+        pool.parallel_for((n + CHUNK - 1) / CHUNK, [&](int c) {
+            visit_range<mode>(
+                c * CHUNK, std::min<size_t>(n, (c + 1) * CHUNK), f
+            );
+        });
+    }
+
+    // handle to live object i, see GenRef
+    template<class Tpacked = uint64_t>
+    GenRef<Obj, Tpacked> gen_ref(idx_t i) {
+        static_assert(with_gen, "Generations are not enabled for Obj");
+        using gen_t = GenRef<Obj, Tpacked>;
+        if constexpr (gen_t::IDX_BITS < sizeof(idx_t) * 8) {
+            if (unlikely(i > gen_t::IDX_MASK)) {
+                THROW(std::length_error, "Index does not fit the handle", i);
+            }
+        }
+        return gen_t(i, __atomic_load_n(&buf_ptr()[i].gen, __ATOMIC_ACQUIRE));
+    }
+
+    template<class Tpacked>
+    INLINE_WRAPPER
+    bool gen_valid(const GenRef<Obj, Tpacked> &r) {
+        auto g = __atomic_load_n(&buf_ptr()[r.index()].gen, __ATOMIC_ACQUIRE);
+        return (r.gen() & 1) && (g & GenRef<Obj, Tpacked>::GEN_MASK) == r.gen();
+    }
+
+    // locked object if the handle is still valid, check with operator bool
+    template<class Tpacked>
+    auto try_use(const GenRef<Obj, Tpacked> &r) {
+        static_assert(!with_seq, "Use use() for optimistic read objects");
+        auto i = r.index();
+        auto &l = lock_pool.get_locker(i);
+        l.lock_c();
+        // deletes bump the generation under the stripe
+        if (unlikely(!gen_valid(r))) {
+            l.unlock_c();
+            return GenUseHolder<Obj, ObjLock>(NULL, NULL);
+        }
+        return GenUseHolder<Obj, ObjLock>(obj_ptr(i), &l);
+    }
+
+    // lock-free copy of the object, see block_alloc_optimistic_read
+    Obj read(idx_t i) {
+        static_assert(with_seq, "Optimistic read is not enabled for Obj");
+        return buf_ptr()[i].read();
+    }
 };
 
 #endif /* __BLOCK_ALLOC_H_ */
@@ -1,28 +1,360 @@
 #ifndef __BLOCK_ALLOC_MOVE_H_
 #define __BLOCK_ALLOC_MOVE_H_
 
-#include <unordered_ma>
-#include "simple_alloc.h"
+#include <chrono>
 
-template<class Obj, class BufferAlloc = SimpleAlloc>
-class BlockAllocMove {
-    using idx_t = unsigned int;
+#include "block_alloc.h"
+#include "block_alloc_tree.h"
+#include "periodic_task.h"
 
-    size_t size;
-    unordered_map<idx_t, idx_t> move_map;
+/* Write access to a moving pool object, follows forwarded slots */
+template<class Talloc, class Obj, class Tl>
+class MoveUseHolder {
+    Obj *o;
+    Tl *l;
 
-    idx_t use(idx_t id) {
-        // TODO: lock, scope lock object ?
-        auto new_id_it = move_map.find(id);
-        if (unlikely(new_id_it != move_map.end())) {
-            id = new_id_it->second;
+    public:
+    INLINE_WRAPPER
+    Obj &obj() {
+        return *o;
+    }
+
+    // `i` is updated when the object was moved
+    MoveUseHolder(Talloc &a, typename Talloc::idx_t &i) {
+        while (true) {
+            a.resolve(i);
+            l = &a.lock_pool.get_locker(i);
+            l->lock_c();
+            if (likely(!a.forwarded(i))) {
+                break;
+            }
+            // moved before we got the stripe
+            l->unlock_c();
         }
-        //
+        o = a.obj_ptr(i);
     }
 
-    void remove(idx_t) {
+    MoveUseHolder(const MoveUseHolder &) = delete;
+
+    INLINE_WRAPPER
+    ~MoveUseHolder() {
+        l->unlock_c();
     }
 };
 
-#endif /* __BLOCK_ALLOC_MOVE_H_ */
+/*
+ * Compacting BlockAlloc, live objects are moved toward the front
+ * The new index of a moved object goes to a forwarding column beside
+ * the slots until the owner handle resolves it on the next use() or
+ * delete_(), handles MUST be single owner ( SingleOwnerRefHolder )
+ * The moved-out index is not reused meanwhile, its slot is not needed:
+ * the tail behind the last live object is returned to the OS like
+ * BlockAlloc::release_free(), see set_release_policy()
+ * compact_step() can run by hand or from a background thread
+ * Capacity grows within the BufferAllocator reservation up to
+ * max_capacity like BlockAlloc, emplace() past it throws
+ * std::length_error, index width follows block_alloc_capacity<Obj>
+ * Obj MUST be move constructible
+ * */
+template<
+    class Obj, class BufferAllocator = SimpleAllocator,
+    class ObjLock = LockObject
+>
+class BlockAllocMove : public LockObject {
+    public:
+        constexpr static uint64_t CAPACITY = block_alloc_capacity<Obj>::value;
+        using idx_t = block_alloc_idx_t<CAPACITY>;
+        constexpr static idx_t idx_type_obj = 0;
+
+    private:
+    template<class, class, class> friend class MoveUseHolder;
+
+    // forwarding entries are read without locks
+    static_assert(
+        std::is_constructible<BufferAllocator, size_t, size_t>::value,
+        "BlockAllocMove needs a buffer with a reservation"
+    );
+
+    struct Slot {
+        alignas(Obj) byte data[sizeof(Obj)];
+    };
+
+    // size is the live tail, changed under the allocator lock only
+    SlotCapacity<idx_t> cap;
+    idx_t live_count = 0;
+    // live or forwarded, i.e. not reusable
+    BitTree used;
+    BitTree live;
+
+    PoolLock<idx_t, block_alloc_stripes(CAPACITY), ObjLock> lock_pool;
+
+    BufferAllocator buffer;
+    // new index + 1 of moved-out slots, 0 ( fresh page ) is none
+    BufferAllocator fwd_buffer;
+
+    // slots touched since the last page release, allocator lock
+    idx_t dirty = 0;
+    size_t release_min_bytes = BLOCK_ALLOC_RELEASE_MIN;
+    bool release_lazy = false;
+
+    // buffer access for SlotCapacity
+    struct Slots {
+        BlockAllocMove &a;
+
+        template<bool can_move>
+        void resize(size_t n) {
+            a.buffer.template resize<can_move>(calc_size(n));
+            a.fwd_buffer.template resize<can_move>(n * sizeof(idx_t));
+        }
+    } slots{*this};
+
+    PeriodicTask compactor;
+
+    INLINE_WRAPPER
+    Slot *buf_ptr() {
+        return (Slot*)buffer.get_data();
+    }
+
+    INLINE_WRAPPER
+    Obj *obj_ptr(idx_t i) {
+        return (Obj*)buf_ptr()[i].data;
+    }
+
+    INLINE_WRAPPER
+    idx_t *fwd_ptr() {
+        return (idx_t*)fwd_buffer.get_data();
+    }
+
+    INLINE_WRAPPER
+    bool forwarded(idx_t i) {
+        return __atomic_load_n(&fwd_ptr()[i], __ATOMIC_ACQUIRE);
+    }
 
+    // allocator lock MUST be held, releases the entry
+    idx_t take_fwd(idx_t i) {
+        auto j = fwd_ptr()[i] - 1;
+        __atomic_store_n(&fwd_ptr()[i], 0, __ATOMIC_RELAXED);
+        used.unset(i);
+        return j;
+    }
+
+    void mark(BitTree &t, idx_t i) {
+        if (unlikely(i >= t.capacity())) {
+            t.resize(std::max((size_t)i + 1, t.capacity() * 2));
+        }
+        t.set(i);
+    }
+
+    // drops the tail behind the last live object, allocator lock
+    void trim() {
+        idx_t new_size = live.last_used() + 1;
+        if (new_size >= cap.size) {
+            return;
+        }
+        __atomic_store_n(&cap.size, new_size, __ATOMIC_RELAXED);
+        if (unlikely(release_min_bytes
+            && calc_size(dirty - cap.size) >= release_min_bytes * 2
+        )) {
+            release_tail(release_min_bytes);
+        }
+    }
+
+    /*
+     * Releases pages behind the live tail, allocator lock MUST be held
+     * A quarter of the live size is kept as headroom against regrowth
+     * */
+    RARE_FUNC
+    size_t release_tail(size_t min_bytes) {
+        auto keep = (size_t)cap.size + cap.size / 4;
+        if (keep >= dirty) {
+            return 0;
+        }
+        auto bytes = calc_size(dirty) - calc_size(keep);
+        if (bytes < min_bytes) {
+            return 0;
+        }
+        buffer.release(calc_size(keep), bytes, release_lazy);
+        dirty = keep;
+        return bytes;
+    }
+
+    // follows and releases forwarding entries, owner handle only
+    INLINE_WRAPPER
+    void resolve(idx_t &i) {
+        if (likely(!forwarded(i))) {
+            return;
+        }
+        auto l = lock();
+        while (forwarded(i)) {
+            i = take_fwd(i);
+        }
+    }
+
+    static size_t calc_size(size_t n) {
+        return n * sizeof(Slot);
+    }
+
+    // allocator lock MUST be held
+    bool move_one() {
+        auto f = used.first_free();
+        auto h = live.last_used();
+        if (h < 0 || f >= (size_t)h) {
+            return false;
+        }
+        // users may hold a stripe while waiting for the allocator lock
+        auto &lh = lock_pool.get_locker(h);
+        auto &lf = lock_pool.get_locker(f);
+        if (!lh.try_lock_c()) {
+            return false;
+        }
+        if (&lf != &lh && !lf.try_lock_c()) {
+            lh.unlock_c();
+            return false;
+        }
+
+        new (obj_ptr(f)) Obj(std::move(*obj_ptr(h)));
+        obj_ptr(h)->~Obj();
+        __atomic_store_n(&fwd_ptr()[h], (idx_t)(f + 1), __ATOMIC_RELEASE);
+        mark(used, f);
+        mark(live, f);
+        live.unset(h);
+
+        if (&lf != &lh) {
+            lf.unlock_c();
+        }
+        lh.unlock_c();
+        return true;
+    }
+
+    public:
+
+    BlockAllocMove(
+        size_t capacity = 16, size_t max_capacity = BLOCK_ALLOC_MAX_CAPACITY
+    )
+        : cap(capacity, max_capacity, CAPACITY),
+          buffer(calc_size(cap.capacity), calc_size(cap.max_capacity)),
+          fwd_buffer(
+              cap.capacity * sizeof(idx_t), cap.max_capacity * sizeof(idx_t)
+          ) {
+    }
+
+    ~BlockAllocMove() {
+        stop_compactor();
+    }
+
+    void set_lock_name(const std::string &name) {
+        LockObject::set_lock_name(name);
+        lock_pool.set_lock_name(name + ".obj");
+    }
+
+    template<class ... Targs>
+    auto emplace(Targs& ...constructor_args) {
+        auto l = lock();
+        size_t f = used.first_free();
+        if (f >= cap.size) {
+            // accessible first, a failed grow leaves nothing behind
+            cap.template reserve<false>(f + 1, slots);
+            // forwarded slots below f stay empty, throws
+            // std::length_error past max_capacity
+            cap.grow((idx_t)(
+                std::min<size_t>(f, cap.max_capacity) + 1 - cap.size
+            ));
+            dirty = std::max(dirty, cap.size);
+        }
+        idx_t i = f;
+        new (obj_ptr(i)) Obj(constructor_args...);
+        mark(used, i);
+        mark(live, i);
+        live_count++;
+        return SingleOwnerRefHolder<Obj>(i);
+    }
+
+    void delete_(idx_t i) {
+        auto l = lock();
+        while (forwarded(i)) {
+            i = take_fwd(i);
+        }
+        { // scope for lock
+            auto lo = lock_pool.lock(i);
+            obj_ptr(i)->~Obj();
+        }
+        live.unset(i);
+        used.unset(i);
+        live_count--;
+        trim();
+    }
+
+    // the handle index is kept up to date by use()
+    idx_t reposition(idx_t i) {
+        return i;
+    }
+
+    auto use(idx_t &i) {
+        return MoveUseHolder<BlockAllocMove, Obj, ObjLock>(*this, i);
+    }
+
+    /*
+     * Moves up to `n` objects from the tail into the lowest holes
+     * Returns the number of moved objects, objects in use are skipped
+     * */
+    int compact_step(int n = 64) {
+        auto l = lock();
+        int moved = 0;
+        while (moved < n && move_one()) {
+            moved++;
+        }
+        trim();
+        return moved;
+    }
+
+    // compacts every `period`, `batch` moves per allocator lock
+    void start_compactor(
+        std::chrono::milliseconds period = std::chrono::milliseconds(100),
+        int batch = 64
+    ) {
+        compactor.start(period, [this, batch]() {
+            return compact_step(batch) == batch;
+        });
+    }
+
+    void stop_compactor() {
+        compactor.stop();
+    }
+
+    /*
+     * trim() releases the tail behind the last live object once it
+     * exceeds 2 * min_bytes, like BlockAlloc::set_release_policy()
+     * 0 disables it, lazy uses MADV_FREE ( RSS drops only under pressure )
+     * */
+    void set_release_policy(size_t min_bytes, bool lazy = false) {
+        auto l = lock();
+        release_min_bytes = min_bytes;
+        release_lazy = lazy;
+    }
+
+    // returns the tail pages to the kernel now
+    size_t release_free() {
+        auto l = lock();
+        return release_tail(0);
+    }
+
+    // slots up to the last live object
+    idx_t used_size() {
+        return __atomic_load_n(&cap.size, __ATOMIC_RELAXED);
+    }
+
+    idx_t get_capacity() {
+        return __atomic_load_n(&cap.capacity, __ATOMIC_ACQUIRE);
+    }
+
+    // address space taken by the pool
+    size_t reserved_bytes() {
+        return buffer.reserved_bytes();
+    }
+
+    idx_t live_size() {
+        return __atomic_load_n(&live_count, __ATOMIC_RELAXED);
+    }
+};
+
+#endif /* __BLOCK_ALLOC_MOVE_H_ */
@@ -0,0 +1,351 @@
+#ifndef __BLOCK_ALLOC_SOA_H_
+#define __BLOCK_ALLOC_SOA_H_
+
+#include <tuple>
+
+#include "block_alloc.h"
+
+/*
+ * Field of a BlockAllocSoA object, declare a tag per field:
+ *   struct Price : SoaField<double> {};
+ * */
+template<class T>
+struct SoaField {
+    using type = T;
+};
+
+/* Compile-time field list, tags MUST be distinct */
+template<class ... Fields>
+struct SoaFields {};
+
+/* Contiguous view of one column */
+template<class T>
+class ColumnSpan {
+    T *ptr;
+    size_t n;
+
+    public:
+    ColumnSpan(T *ptr, size_t n) : ptr(ptr), n(n) {}
+
+    INLINE_WRAPPER
+    T *data() {
+        return ptr;
+    }
+
+    INLINE_WRAPPER
+    size_t size() {
+        return n;
+    }
+
+    INLINE_WRAPPER
+    T *begin() {
+        return ptr;
+    }
+
+    INLINE_WRAPPER
+    T *end() {
+        return ptr + n;
+    }
+
+    INLINE_WRAPPER
+    T &operator[](size_t i) {
+        return ptr[i];
+    }
+};
+
+/* Proxy reference to the fields of one object */
+template<class Talloc>
+class SoaRef {
+    using idx_t = typename Talloc::idx_t;
+
+    Talloc &a;
+    idx_t i;
+
+    public:
+    INLINE_WRAPPER
+    SoaRef(Talloc &a, idx_t i) : a(a), i(i) {}
+
+    template<class F>
+    INLINE_WRAPPER
+    typename F::type &get() {
+        return a.template column_data<F>()[i];
+    }
+
+    INLINE_WRAPPER
+    idx_t index() {
+        return i;
+    }
+};
+
+/* SoaRef holding the object stripe */
+template<class Talloc, class Tl>
+class SoaUseHolder : public SoaRef<Talloc> {
+    decltype(((Tl*)NULL)->lock()) l;
+
+    public:
+    INLINE_WRAPPER
+    SoaUseHolder(Talloc &a, typename Talloc::idx_t i, Tl &lock)
+        : SoaRef<Talloc>(a, i), l(lock.lock()) {}
+
+    INLINE_WRAPPER
+    SoaRef<Talloc> &obj() {
+        return *this;
+    }
+};
+
+/*
+ * BlockAlloc storing each field of Fields = SoaFields<...> in its own
+ * column, passes over one field read only that column
+ * use(i) returns a proxy, fields are read by tag: h.get<Price>()
+ * Columns reserve address space for max_capacity like BlockAlloc and
+ * never move while within it, column<F>() spans stay valid then
+ * Spans cover slots [0, used_size()), free slots hold value-initialized
+ * fields, scans take no locks and race with concurrent writers
+ * Columns without a reservation move on growth, see SlotCapacity, spans
+ * MUST NOT be used across emplace() then
+ * Index width and stripes follow block_alloc_capacity<Obj>
+ * Field types MUST be trivially copyable
+ * */
+template<
+    class Obj, class Fields, class BufferAllocator = SimpleAllocator,
+    class ObjLock = LockObject,
+    template<class> class FreeIndex = FreeIndexSet
+>
+class BlockAllocSoA;
+
+template<
+    class Obj, class ... F, class BufferAllocator, class ObjLock,
+    template<class> class FreeIndex
+>
+class BlockAllocSoA<Obj, SoaFields<F...>, BufferAllocator, ObjLock, FreeIndex>
+    : public LockObject {
+    public:
+        constexpr static uint64_t CAPACITY = block_alloc_capacity<Obj>::value;
+        using idx_t = block_alloc_idx_t<CAPACITY>;
+        constexpr static idx_t idx_type_obj = 0;
+
+    private:
+    template<class> friend class SoaRef;
+
+    static_assert(
+        (std::is_trivially_copyable<typename F::type>::value && ...),
+        "SoA fields MUST be trivially copyable"
+    );
+
+    // no address space reservation, growth may move the columns
+    constexpr static bool can_move =
+        !std::is_constructible<BufferAllocator, size_t, size_t>::value;
+
+    static_assert(
+        !can_move || FreeIndex<idx_t>::needs_lock,
+        "Buffers without a reservation need a locking free index"
+    );
+
+    template<class Tf>
+    struct Column {
+        using T = typename Tf::type;
+
+        BufferAllocator buffer;
+
+        Column(size_t capacity, size_t max_capacity)
+            : buffer(make_buffer(
+                capacity * sizeof(T), (size_t)max_capacity * sizeof(T)
+            )) {
+        }
+
+        INLINE_WRAPPER
+        T *data() {
+            return (T*)buffer.get_data();
+        }
+
+        template<bool move>
+        void resize(size_t n) {
+            buffer.template resize<move>(n * sizeof(T));
+        }
+    };
+
+    struct Link : SoaField<idx_t> {};
+
+    SlotCapacity<idx_t> cap;
+    FreeIndex<idx_t> free_index;
+
+    PoolLock<idx_t, block_alloc_stripes(CAPACITY), ObjLock> lock_pool;
+
+    // next_free of free slots
+    Column<Link> links;
+    std::tuple<Column<F>...> cols;
+
+    static BufferAllocator make_buffer(size_t bytes, size_t max_bytes) {
+        if constexpr (
+            std::is_constructible<BufferAllocator, size_t, size_t>::value
+        ) {
+            return BufferAllocator(bytes, max_bytes);
+        } else {
+            return BufferAllocator(bytes);
+        }
+    }
+
+    template<class Tf>
+    INLINE_WRAPPER
+    typename Tf::type *column_data() {
+        return std::get<Column<Tf>>(cols).data();
+    }
+
+    // slot array access for the free index and SlotCapacity
+    struct Slots {
+        BlockAllocSoA &a;
+
+        INLINE_WRAPPER
+        idx_t &link(idx_t i) {
+            return a.links.data()[i];
+        }
+
+        // columns that may move grow once the allocator lock is released
+        INLINE_WRAPPER
+        idx_t grow(idx_t n) {
+            auto s = a.cap.grow(n);
+            if constexpr (!can_move) {
+                a.reserve((size_t)s + n);
+            }
+            return s;
+        }
+
+        template<bool move>
+        void resize(size_t n) {
+            a.links.template resize<move>(n);
+            (std::get<Column<F>>(a.cols).template resize<move>(n), ...);
+        }
+
+        auto lock_all() {
+            return a.lock_pool.lock_all();
+        }
+    } slots{*this};
+
+    // allocator lock MUST NOT be held if the columns can move
+    INLINE_WRAPPER
+    void reserve(size_t need) {
+        cap.template reserve<can_move>(need, slots);
+    }
+
+    // runs f() under the allocator lock if the free index needs it
+    template<class Tf>
+    INLINE_WRAPPER
+    auto with_free_index(Tf &&f) {
+        return with_free_index_lock<FreeIndex<idx_t>>(*this, f);
+    }
+
+    void clear_fields(idx_t i) {
+        ((column_data<F>()[i] = typename F::type()), ...);
+    }
+
+    void free_slot(idx_t i) {
+        with_free_index([&]() {
+            free_index.push(i, slots);
+            free_index.trim(cap.size);
+        });
+    }
+
+    idx_t alloc_slot() {
+        auto new_pos = with_free_index([&]() {
+            idx_t new_pos;
+            if (!free_index.pop(new_pos, slots)) {
+                new_pos = slots.grow(1);
+            }
+            return new_pos;
+        });
+        reserve((size_t)new_pos + 1);
+        return new_pos;
+    }
+
+    bool should_reposition(idx_t i) {
+        auto n_free = free_index.count();
+        if (!n_free) {
+            return false;
+        }
+        return i >= __atomic_load_n(&cap.size, __ATOMIC_RELAXED) - n_free;
+    }
+
+    public:
+
+    BlockAllocSoA(
+        size_t capacity = 16, size_t max_capacity = BLOCK_ALLOC_MAX_CAPACITY
+    )
+        : cap(capacity, max_capacity, CAPACITY),
+          links(cap.capacity, cap.max_capacity),
+          cols(Column<F>(cap.capacity, cap.max_capacity)...) {
+    }
+
+    idx_t get_capacity() {
+        return __atomic_load_n(&cap.capacity, __ATOMIC_ACQUIRE);
+    }
+
+    // slots in use, including free ones below the last used slot
+    idx_t used_size() {
+        return __atomic_load_n(&cap.size, __ATOMIC_ACQUIRE);
+    }
+
+    void set_lock_name(const std::string &name) {
+        LockObject::set_lock_name(name);
+        lock_pool.set_lock_name(name + ".obj");
+    }
+
+    // one value per field, in SoaFields order
+    auto emplace(const typename F::type &...values) {
+        auto i = alloc_slot();
+        if constexpr (can_move) {
+            // keeps the columns in place
+            auto lo = lock_pool.lock(i);
+            ((column_data<F>()[i] = values), ...);
+        } else {
+            ((column_data<F>()[i] = values), ...);
+        }
+        return SingleOwnerRefHolder<Obj>(i);
+    }
+
+    void delete_(idx_t i) {
+        { // scope for lock
+            auto lo = lock_pool.lock(i);
+            clear_fields(i);
+        }
+        free_slot(i);
+    }
+
+    // moves object i to a lower free slot, returns its new index
+    idx_t reposition(idx_t i) {
+        if (!should_reposition(i)) {
+            return i;
+        }
+        idx_t new_pos;
+        if (!with_free_index([&]() {
+            return free_index.pop_below(i, new_pos, slots);
+        })) {
+            return i;
+        }
+        { // scope for lock
+            auto lo = lock_pool.lock_many(i, new_pos);
+            ((column_data<F>()[new_pos] = column_data<F>()[i]), ...);
+            clear_fields(i);
+        }
+        free_slot(i);
+        return new_pos;
+    }
+
+    template<class ... Tidx>
+    auto lock_objs(Tidx ...ids) {
+        return lock_pool.lock_many(((idx_t)ids)...);
+    }
+
+    auto use(idx_t i) {
+        return SoaUseHolder<BlockAllocSoA, ObjLock>(
+            *this, i, lock_pool.get_locker(i)
+        );
+    }
+
+    // column of field Tf over slots [0, used_size())
+    template<class Tf>
+    ColumnSpan<typename Tf::type> column() {
+        return ColumnSpan<typename Tf::type>(column_data<Tf>(), used_size());
+    }
+};
+
+#endif /* __BLOCK_ALLOC_SOA_H_ */
@@ -1,233 +1,316 @@
-#ifndef __BLOCK_ALLOC_H_
-#define __BLOCK_ALLOC_H_
+#ifndef __BLOCK_ALLOC_TREE_H_
+#define __BLOCK_ALLOC_TREE_H_
 
-template<class T>
-inline int bit_size(T v = 0) {
-    return sizeof(T) << 3;
-}
+#include <utils/utils.h>
 
-template<class T>
-inline T full_mask(T v = 0) {
-    return ~(T)0;
-}
+#include <cstdint>
+#include <vector>
 
-bool is_p2(auto n) {
-    return !((n - 1) & n);
-}
+#include "simple_alloc.h"
 
-template<class Tn>
-Tn lowest_p2(Tn v) {
-    auto s = bit_size(v);
-    Tn r = 1;
-    while (s >>= 1) {
-        auto nr = r << s;
-        if (nr <= v) {
-            r = nr;
-        }
-    }
-    return r;
-}
+/*
+ * Bit word helpers, build with -mbmi -mlzcnt to get tzcnt / lzcnt
+ * */
+using bit_word_t = uint64_t;
 
-template<class Tn>
-inline Tn div_by_const(Tn v, Tn d) {
-    if (is_p2(d)) {
-        return v >> lowest_p2(d);
-    } else {
-        return v / d;
-    }
+constexpr int BIT_WORD_BITS = 64;
+constexpr int BIT_WORD_SHIFT = 6;
+
+INLINE_WRAPPER
+bit_word_t word_bit(size_t pos) {
+    return ((bit_word_t)1) << (pos & (BIT_WORD_BITS - 1));
 }
 
-template<class Tn>
-inline Tn mul_by_const(Tn v, Tn d) {
-    if (is_p2(d)) {
-        return v << lowest_p2(d);
-    } else {
-        return v * d;
-    }
+// v MUST be non-zero
+INLINE_WRAPPER
+int word_first_set(bit_word_t v) {
+    return __builtin_ctzll(v);
 }
 
-template<class Tn>
-inline Tn set_bits(int n, Tn v = 0) {
-    return full_mask(v) >> (bit_size(v) - n);
+// v MUST be non-zero
+INLINE_WRAPPER
+int word_last_set(bit_word_t v) {
+    return BIT_WORD_BITS - 1 - __builtin_clzll(v);
 }
 
-//template<class Tbit> bool has_free(Tbit v);
-//template<class Tbit> bool has_used(Tbit v)
-//template<class Tbit> int first_free(Tbit v);
-//template<class Tbit> int last_used(Tbit v);
+/*
+ * Multi-level bitmap, bit set means slot is used
+ * Every summary level keeps two bitmaps over the level below:
+ * free - child word has a zero bit, used - child word has a set bit
+ * set / unset / first_free / last_used walk one word per level
+ * Not thread safe
+ * */
+class BitTree {
+    std::vector<bit_word_t> bits;
+    // [0] summarizes bits, [k] summarizes [k-1], last one is a single word
+    std::vector<std::vector<bit_word_t>> free_idx;
+    std::vector<std::vector<bit_word_t>> used_idx;
 
-template<class Tbit>
-bool val_has_free(Tbit v) {
-    return ~v;
-}
+    static size_t words_for(size_t n) {
+        return (n + BIT_WORD_BITS - 1) >> BIT_WORD_SHIFT;
+    }
 
-template<class Tbit>
-bool val_has_used(Tbitv) {
-    return v;
-}
+    // child word went empty <-> non-empty, update summaries upwards
+    static void mark_up(
+        std::vector<std::vector<bit_word_t>> &levels, size_t child, bool on
+    ) {
+        for (auto &level : levels) {
+            auto &w = level[child >> BIT_WORD_SHIFT];
+            auto old = w;
+            if (on) {
+                w |= word_bit(child);
+                if (old) {
+                    return;
+                }
+            } else {
+                w &= ~word_bit(child);
+                if (w) {
+                    return;
+                }
+            }
+            child >>= BIT_WORD_SHIFT;
+        }
+    }
 
-template<class Tbit>
-auto val_set_nbit(Tbit v, int n) {
-    return v | (((Tbit)1) << n);
-}
+    void rebuild() {
+        free_idx.clear();
+        used_idx.clear();
+        auto n = bits.size();
+        do {
+            auto sz = words_for(n);
+            free_idx.emplace_back(sz, 0);
+            used_idx.emplace_back(sz, 0);
+            n = sz;
+        } while (n > 1);
+
+        for (size_t w = 0; w < bits.size(); w++) {
+            if (~bits[w]) {
+                mark_up(free_idx, w, true);
+            }
+            if (bits[w]) {
+                mark_up(used_idx, w, true);
+            }
+        }
+    }
 
-template<class Tbit>
-auto val_unset_nbit(Tbit v, int n) {
-    return v & ~(((Tbit)1) << n);
-}
+    public:
+    // capacity is rounded up to whole words
+    BitTree(size_t capacity = BIT_WORD_BITS)
+        : bits(std::max(words_for(capacity), (size_t)1), 0) {
+        rebuild();
+    }
 
-template<class Tbit>
-auto val_get_nbit(Tbit v, int n) {
-    return (v>>n) & 1;
-}
+    size_t capacity() {
+        return bits.size() << BIT_WORD_SHIFT;
+    }
 
-template<class Tbit>
-void set_bit_at_pos(Tbit *data, size_t pos) {
-    auto &p = data[elem_pos(pos)];
-    p = val_set_nbit(p, bit_pos(pos));
-}
+    // new slots are free, shrinking is not supported
+    void resize(size_t capacity) {
+        auto n = words_for(capacity);
+        if (n > bits.size()) {
+            bits.resize(n, 0);
+            rebuild();
+        }
+    }
 
-template<class Tbit>
-void unset_bit_at_pos(Tbit *data, size_t pos) {
-    auto &p = data[elem_pos(pos)];
-    p = val_unset_nbit(p, bit_pos(pos));
-}
+    INLINE_WRAPPER
+    bool test(size_t pos) {
+        return bits[pos >> BIT_WORD_SHIFT] & word_bit(pos);
+    }
 
-template<class Tbit>
-int val_first_free(Tbit v) {
-    v = ~v;
-    int r = 0;
+    void set(size_t pos) {
+        auto w = pos >> BIT_WORD_SHIFT;
+        auto old = bits[w];
+        bits[w] |= word_bit(pos);
+        if (!old) {
+            mark_up(used_idx, w, true);
+        }
+        if (!~bits[w]) {
+            mark_up(free_idx, w, false);
+        }
+    }
 
-    auto l = bit_size(v);
-    auto bb = full_mask(v);
-    while (l >>= 1) {
-        bb >>= l;
-        if (!(bb & v)) {
-            v >>= l;
-            r += l;
+    void unset(size_t pos) {
+        auto w = pos >> BIT_WORD_SHIFT;
+        auto old = bits[w];
+        bits[w] &= ~word_bit(pos);
+        if (!~old) {
+            mark_up(free_idx, w, true);
+        }
+        if (!bits[w]) {
+            mark_up(used_idx, w, false);
         }
     }
-    return r;
-}
 
-template<class Tbit>
-int val_last_used(Tbit v) {
-    int r = 0;
+    // lowest unset bit, capacity() if all are set
+    size_t first_free() {
+        if (!free_idx.back()[0]) {
+            return capacity();
+        }
+        size_t pos = 0;
+        for (auto l = free_idx.size(); l-- > 0;) {
+            pos = (pos << BIT_WORD_SHIFT)
+                | word_first_set(free_idx[l][pos]);
+        }
+        return (pos << BIT_WORD_SHIFT) | word_first_set(~bits[pos]);
+    }
 
-    auto l = bit_size(v);
-    auto bb = full_mask(v);
-    while (l >>= 1) {
-        bb <<= l;
-        if (set_bits(l) & v) {
-            r += l;
-        } else {
-            v <<= l;
+    // highest set bit, -1 if none
+    ssize_t last_used() {
+        if (!used_idx.back()[0]) {
+            return -1;
+        }
+        size_t pos = 0;
+        for (auto l = used_idx.size(); l-- > 0;) {
+            pos = (pos << BIT_WORD_SHIFT)
+                | word_last_set(used_idx[l][pos]);
         }
+        return (pos << BIT_WORD_SHIFT) | word_last_set(bits[pos]);
     }
-    return r;
-}
+};
 
-template<class Tbit, class Tsize = int, class idx_levels = 2>
-class BitTree {
-    Tbit *data = NULL;
-    Tsize data_size = 0;
-    Tsize idx_size = 0;
+/*
+ * Flat bitmap with atomic set / unset, readable while being updated
+ * Address space for max_bits is reserved up front, resize() never
+ * moves the words
+ * */
+class SlotBitmap {
+    SimpleAllocator buffer;
 
-    constexpr auto type_bit_size() {
-        return bit_size<Tbit>();
+    static size_t bytes_for(size_t n) {
+        return ((n + BIT_WORD_BITS - 1) >> BIT_WORD_SHIFT) * sizeof(bit_word_t);
     }
 
-    inline auto reduce_ceil(size_t bit_pos) {
-        return div_by_const(
-            bit_pos + (type_bit_size() - 1), type_bit_size()
-        );
+    public:
+    SlotBitmap(size_t bits, size_t max_bits)
+        : buffer(bytes_for(bits), bytes_for(max_bits)) {
     }
 
-    inline auto nlevel_size(int n) {
-        auto r = data_size;
-        for (int i=0; i<n-1; i++) {
-            r = reduce_ceil(r);
-        }
-        return r;
+    void resize(size_t bits) {
+        buffer.resize(bytes_for(bits));
     }
 
-    inline auto bit_pos(size_t bit_pos) {
-        return bit_pos & set_bits(lowest_p2(type_bit_size()), bit_pos);
+    INLINE_WRAPPER
+    bit_word_t *words() {
+        return (bit_word_t*)buffer.get_data();
     }
 
-    inline auto elem_pos(size_t bit_pos) {
-        return div_by_const(bit_pos, type_bit_size());
+    INLINE_WRAPPER
+    bit_word_t word(size_t w) {
+        return __atomic_load_n(&words()[w], __ATOMIC_ACQUIRE);
     }
 
-    bool get_bit_at_pos(size_t pos) {
-        auto &p = data[elem_pos(pos)];
-        return val_get_nbit(p, bit_pos(pos));
+    INLINE_WRAPPER
+    bool test(size_t pos) {
+        return word(pos >> BIT_WORD_SHIFT) & word_bit(pos);
     }
 
-    BitTree(Tbit *data, size_t bit_len) {
-        data_size = reduce_ceil(bit_len);
-        auto sz = data_size
-
-        idx_size = 1;
-        while ((sz = reduce_ceil(sz)) > 1) {
-            idx_size += sz;
-        }
+    INLINE_WRAPPER
+    void set(size_t pos) {
+        __atomic_fetch_or(
+            &words()[pos >> BIT_WORD_SHIFT], word_bit(pos), __ATOMIC_RELEASE
+        );
+    }
 
-        std::fill(data, data + (data_size + idx_size), 0);
-        std::fill(
-            data + (data_size + idx_size),
-            data + (data_size + 2 * idx_size),
-            full_mask(data[0]);
+    INLINE_WRAPPER
+    void unset(size_t pos) {
+        __atomic_fetch_and(
+            &words()[pos >> BIT_WORD_SHIFT], ~word_bit(pos), __ATOMIC_RELEASE
         );
     }
+};
 
-    inline void update_idx(size_t bit_pos) {
-        Tbit *set_idx_pos = data + data_size;
-        Tbit *unset_idx_pos = data + data_size + idx_size;
-        while ((bit_pos = reduce_ceil(bit_pos)) > 1) {
+/*
+ * BlockAlloc free index on top of BitTree, see mem/free_index.h
+ * Lowest free slot first like FreeIndexSet, no per slot node allocation
+ * */
+template<class Tidx>
+class FreeIndexTree {
+    BitTree used;
+    Tidx num_free = 0;
+    // slots below were handed out at least once
+    Tidx grown = 0;
+
+    void mark_used(Tidx i) {
+        if (unlikely(i >= used.capacity())) {
+            used.resize(std::max((size_t)i + 1, used.capacity() * 2));
         }
+        used.set(i);
     }
 
-    void set(size_t bit_pos) {
-        set_bit_at_pos(bit_pos);
-        update_free_idx(bit_pos);
-        update_used_idx(bit_pos);
-    }
+    public:
+    constexpr static bool needs_lock = true;
 
-    void unset(size_t bit_pos) {
-        unset_bit_at_pos(bit_pos);
-        update_free_idx(bit_pos);
-        update_used_idx(bit_pos);
+    size_t count() {
+        return num_free;
     }
 
-    Tsize first_free() {
-        auto idx_ptr = data + nlevel_size(0) + idx_size;
+    // never used slots are taken through slots.grow() to keep size
+    template<class Tslots>
+    bool pop(Tidx &i, Tslots &slots) {
+        if (num_free) {
+            i = used.first_free();
+            num_free--;
+        } else {
+            i = slots.grow(1);
+            // pool may not start at 0, never hand out the skipped slots
+            while (grown < i) {
+                mark_used(grown++);
+            }
+            grown = std::max(grown, (Tidx)(i + 1));
+        }
+        mark_used(i);
+        return true;
+    }
 
-        size_t pos = 0;
-        auto top_size = nlevel_size();
-        while (pos < top_size && val_has_used(idx_ptr[pos])) {
-            pos++;
+    template<class Tslots>
+    bool pop_below(Tidx bound, Tidx &i, Tslots &) {
+        if (!num_free) {
+            return false;
         }
-        // raise ??? !
+        auto pos = used.first_free();
+        if (pos >= bound) {
+            return false;
+        }
+        i = pos;
+        num_free--;
+        used.set(i);
+        return true;
+    }
 
-        for (int i=0; i<idx_levels; i++) {
-            auto bit_shift = val_first_free(idx_ptr[pos]);
-            pos = mul_by_const(pos, type_bit_size()) | bit_shift;
-            idx_ptr += nlevel_size();
+    // free slots only, pop() would grow the pool
+    template<class Tslots>
+    int pop_many(Tidx *out, int n, Tslots &) {
+        int k = 0;
+        for (; k < n && num_free; k++) {
+            out[k] = used.first_free();
+            used.set(out[k]);
+            num_free--;
         }
-        auto bit_shift = val_first_free(data[pos]);
-        return mul_by_const(pos, type_bit_size()) | bit_shift;
+        return k;
     }
-};
 
-template<class T, class Tid=int, class Tbit = int>
-class BlockAlloc {
-    T *objs = NULL;
-    m128i *chk = NULL;
+    template<class Tslots>
+    void push(Tidx i, Tslots &) {
+        used.unset(i);
+        num_free++;
+    }
 
-    BlockAlloc() {
+    template<class Tslots>
+    void push_many(const Tidx *in, int n, Tslots &slots) {
+        for (int k = 0; k < n; k++) {
+            push(in[k], slots);
+        }
     }
-};
 
-#endif /* __BLOCK_ALLOC_H_ */
+    // drops free slots from the end of [0, size)
+    void trim(Tidx &size) {
+        Tidx new_size = used.last_used() + 1;
+        if (new_size < size) {
+            num_free -= size - new_size;
+            size = new_size;
+        }
+    }
+};
 
+#endif /* __BLOCK_ALLOC_TREE_H_ */
@@ -0,0 +1,137 @@
+#ifndef __COND_VAR_H_
+#define __COND_VAR_H_
+
+#include <chrono>
+#include <errno.h>
+#include <type_traits>
+
+#include "futex.h"
+
+/*
+ * Lock types that can take requeued waiters directly on their futex word
+ * They provide futex_word(), mark_contended() and lock_contended_c()
+ * */
+template<class Tl, class = void>
+struct lock_supports_requeue : std::false_type {};
+
+template<class Tl>
+struct lock_supports_requeue<Tl, std::void_t<
+    decltype(((Tl*)NULL)->futex_word()),
+    decltype(((Tl*)NULL)->mark_contended()),
+    decltype(((Tl*)NULL)->lock_contended_c())
+>> : std::true_type {};
+
+/*
+ * Sequence counter condition variable, works with any lock in mem/
+ * Notify bumps the sequence before waking, so a notify that comes
+ * between unlock and futex wait is never lost
+ * */
+class CondVar {
+    futex_t seq = 0;
+    int num_waiters = 0;
+
+    template<class Tl>
+    inline void relock(Tl &l) {
+        if constexpr (lock_supports_requeue<Tl>::value) {
+            // there may be more requeued waiters behind us
+            l.lock_contended_c();
+        } else {
+            l.lock_c();
+        }
+    }
+
+    template<class Tl>
+    inline int __wait(Tl &l, const struct timespec *timeout) {
+        auto s = futex_load(&seq);
+        __sync_add_and_fetch(&num_waiters, 1);
+        l.unlock_c();
+        auto r = futex_wait(&seq, s, timeout);
+        auto err = errno;
+        __sync_add_and_fetch(&num_waiters, -1);
+        relock(l);
+        return r ? err : 0;
+    }
+
+    inline bool has_waiters() {
+        return __atomic_load_n(&num_waiters, __ATOMIC_ACQUIRE);
+    }
+
+    public:
+
+    // `l` MUST be locked, spurious wakeups are possible
+    template<class Tl>
+    void wait(Tl &l) {
+        __wait(l, NULL);
+    }
+
+    template<class Tl, class Tpred>
+    void wait(Tl &l, Tpred pred) {
+        while (!pred()) {
+            wait(l);
+        }
+    }
+
+    // false on timeout
+    template<class Tl, class Rep, class Period>
+    bool wait_for(Tl &l, std::chrono::duration<Rep, Period> d) {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+        if (ns < 0) {
+            ns = 0;
+        }
+        struct timespec timeout;
+        timeout.tv_sec = ns / 1000000000;
+        timeout.tv_nsec = ns % 1000000000;
+        return __wait(l, &timeout) != ETIMEDOUT;
+    }
+
+    template<class Tl, class Rep, class Period, class Tpred>
+    bool wait_for(Tl &l, std::chrono::duration<Rep, Period> d, Tpred pred) {
+        auto end = std::chrono::steady_clock::now() + d;
+        while (!pred()) {
+            auto left = end - std::chrono::steady_clock::now();
+            if (left.count() <= 0 || !wait_for(l, left)) {
+                return pred();
+            }
+        }
+        return true;
+    }
+
+    void notify_one() {
+        __sync_add_and_fetch(&seq, 1);
+        if (has_waiters()) {
+            futex_wake(&seq, 1);
+        }
+    }
+
+    void notify_all() {
+        __sync_add_and_fetch(&seq, 1);
+        if (has_waiters()) {
+            futex_wake_all(&seq);
+        }
+    }
+
+    /*
+     * Wakes one waiter and moves the rest onto the lock futex,
+     * they are woken one by one by unlock instead of stampeding
+     * `l` MUST be held by the caller
+     * */
+    template<class Tl>
+    void notify_all(Tl &l) {
+        if constexpr (lock_supports_requeue<Tl>::value) {
+            auto s = __sync_add_and_fetch(&seq, 1);
+            if (has_waiters()) {
+                l.mark_contended();
+                while (futex_call(
+                    &seq, FUTEX_CMP_REQUEUE_PRIVATE, 1,
+                    (const struct timespec *)(long)INT_MAX, l.futex_word(), s
+                ) < 0 && errno == EAGAIN) {
+                    s = futex_load(&seq);
+                }
+            }
+        } else {
+            notify_all();
+        }
+    }
+};
+
+#endif /* __COND_VAR_H_ */
@@ -0,0 +1,241 @@
+#ifndef __EPOCH_H_
+#define __EPOCH_H_
+
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+#include "lock.h"
+#include "thread_records.h"
+
+/* Retired objects per thread between reclamation attempts */
+#define EPOCH_RECLAIM_EVERY 64
+
+class EpochDomain;
+
+/* Reader critical section, see EpochDomain::pin() */
+class EpochGuard {
+    EpochDomain *d;
+
+    public:
+    INLINE_WRAPPER
+    EpochGuard(EpochDomain &d);
+
+    EpochGuard(const EpochGuard &) = delete;
+
+    INLINE_WRAPPER
+    ~EpochGuard();
+};
+
+/*
+ * Epoch based reclamation
+ * Readers pin the current epoch for the time they hold raw references,
+ * retire() defers a free into a per thread limbo list tagged with the
+ * epoch, it runs once the global epoch moved 2 steps ahead, i.e. every
+ * reader that could see the object has left. The epoch advances when
+ * all pinned threads have seen the current one, a stalled reader holds
+ * back reclamation of everything retired after it pinned
+ * Limbo of exited threads is handed to the domain, the destructor runs
+ * all pending frees and MUST NOT race with readers
+ * */
+class EpochDomain {
+    friend class EpochGuard;
+
+    // deferred fn(ctx, arg)
+    struct Deferred {
+        void (*fn)(void*, uint64_t);
+        void *ctx;
+        uint64_t arg;
+
+        void run() {
+            fn(ctx, arg);
+        }
+    };
+
+    struct Limbo {
+        uint64_t epoch = 0;
+        std::vector<Deferred> items;
+
+        void run() {
+            for (auto &d : items) {
+                d.run();
+            }
+            items.clear();
+        }
+    };
+
+    struct alignas(64) Record {
+        EpochDomain *owner;
+        // pinned epoch << 1 | 1, 0 when not pinned
+        uint64_t state = 0;
+        int nesting = 0;
+        int retired = 0;
+        Limbo limbo[3];
+    };
+
+    using Records = ThreadRecords<EpochDomain, Record>;
+    friend Records;
+
+    uint64_t global = 1;
+
+    LockObject reg_lock;
+    std::vector<Record*> records;
+    std::vector<Limbo> orphans;
+
+    // thread exit, the limbo goes to orphans
+    void release(Record *r) {
+        auto l = reg_lock.lock();
+        for (auto &lb : r->limbo) {
+            if (!lb.items.empty()) {
+                orphans.push_back(std::move(lb));
+            }
+        }
+        records.erase(std::find(records.begin(), records.end(), r));
+    }
+
+    void attach(Record *r) {
+        auto l = reg_lock.lock();
+        records.push_back(r);
+    }
+
+    INLINE_WRAPPER
+    Record &record() {
+        return Records::get(this);
+    }
+
+    INLINE_WRAPPER
+    void enter() {
+        auto &r = record();
+        if (r.nesting++) {
+            return;
+        }
+        auto e = __atomic_load_n(&global, __ATOMIC_RELAXED);
+        __atomic_store_n(&r.state, (e << 1) | 1, __ATOMIC_RELAXED);
+        // the pin MUST be visible before any reference is loaded
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+
+    INLINE_WRAPPER
+    void leave() {
+        auto &r = record();
+        if (--r.nesting) {
+            return;
+        }
+        __atomic_store_n(&r.state, 0, __ATOMIC_RELEASE);
+    }
+
+    // global epoch + 1 if every pinned thread has seen it
+    bool try_advance() {
+        auto l = reg_lock.lock();
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        auto e = __atomic_load_n(&global, __ATOMIC_RELAXED);
+        for (auto *r : records) {
+            auto s = __atomic_load_n(&r->state, __ATOMIC_ACQUIRE);
+            if ((s & 1) && (s >> 1) != e) {
+                return false;
+            }
+        }
+        __atomic_store_n(&global, e + 1, __ATOMIC_RELEASE);
+
+        auto it = std::partition(orphans.begin(), orphans.end(),
+            [e](Limbo &lb) {
+                return lb.epoch + 1 > e;
+            }
+        );
+        for (auto i = it; i != orphans.end(); ++i) {
+            i->run();
+        }
+        orphans.erase(it, orphans.end());
+        return true;
+    }
+
+    // runs the calling thread limbo lists retired 2 epochs ago
+    void reclaim(Record &r) {
+        auto e = __atomic_load_n(&global, __ATOMIC_ACQUIRE);
+        for (auto &lb : r.limbo) {
+            if (!lb.items.empty() && lb.epoch + 2 <= e) {
+                lb.run();
+            }
+        }
+    }
+
+    public:
+    EpochDomain() = default;
+    EpochDomain(const EpochDomain &) = delete;
+
+    ~EpochDomain() {
+        auto ld = Records::detach_lock().lock();
+        auto l = reg_lock.lock();
+        for (auto &lb : orphans) {
+            lb.run();
+        }
+        for (auto *r : records) {
+            for (auto &lb : r->limbo) {
+                lb.run();
+            }
+            r->owner = NULL;
+        }
+    }
+
+    // reader critical section, nests
+    EpochGuard pin() {
+        return EpochGuard(*this);
+    }
+
+    /*
+     * Runs fn(ctx, arg) once no pinned reader can hold the object
+     * Every EPOCH_RECLAIM_EVERY calls try to advance and reclaim
+     * */
+    void retire(void (*fn)(void*, uint64_t), void *ctx, uint64_t arg) {
+        auto &r = record();
+        auto e = __atomic_load_n(&global, __ATOMIC_ACQUIRE);
+        auto &lb = r.limbo[e % 3];
+        if (lb.epoch != e) {
+            // 3 epochs old
+            lb.run();
+            lb.epoch = e;
+        }
+        lb.items.push_back({fn, ctx, arg});
+        if (unlikely(++r.retired >= EPOCH_RECLAIM_EVERY)) {
+            r.retired = 0;
+            try_advance();
+            reclaim(r);
+        }
+    }
+
+    /*
+     * Advances as far as readers allow and runs the calling thread
+     * limbo lists that became safe, true when nothing of it is left
+     * */
+    bool synchronize() {
+        auto &r = record();
+        for (int k = 0; k < 2 && try_advance(); k++) {}
+        reclaim(r);
+        for (auto &lb : r.limbo) {
+            if (!lb.items.empty()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    uint64_t epoch() {
+        return __atomic_load_n(&global, __ATOMIC_ACQUIRE);
+    }
+};
+
+EpochGuard::EpochGuard(EpochDomain &d) : d(&d) {
+    d.enter();
+}
+
+EpochGuard::~EpochGuard() {
+    d->leave();
+}
+
+/* Process wide domain */
+inline EpochDomain &default_epoch_domain() {
+    static EpochDomain d;
+    return d;
+}
+
+#endif /* __EPOCH_H_ */
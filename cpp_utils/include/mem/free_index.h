@@ -0,0 +1,390 @@
+#ifndef __FREE_INDEX_H_
+#define __FREE_INDEX_H_
+
+#include <set>
+#include <vector>
+#include <algorithm>
+
+#include "lock.h"
+#include "thread_records.h"
+
+/*
+ * Free slot index policies for BlockAlloc
+ * needs_lock: pop / push run under the allocator lock
+ * pop_many / push_many move a batch of slots at once
+ * Tslots gives access to the slot array:
+ *   link(i) - next_free field of free slot i
+ *   grow(n) - takes n never used slots, returns the first one
+ * */
+
+/* Runs f() under the allocator lock `l` if Tfree needs it */
+template<class Tfree, class Tl, class Tf>
+INLINE_WRAPPER
+auto with_free_index_lock(Tl &l, Tf &&f) {
+    if constexpr (Tfree::needs_lock) {
+        auto h = l.lock();
+        return f();
+    } else {
+        return f();
+    }
+}
+
+/* Ordered set, always reuses the lowest free slot and trims the tail */
+template<class Tidx>
+class FreeIndexSet {
+    std::set<Tidx> free_blocks;
+
+    public:
+    constexpr static bool needs_lock = true;
+
+    size_t count() {
+        return free_blocks.size();
+    }
+
+    template<class Tslots>
+    bool pop(Tidx &i, Tslots &) {
+        auto it = free_blocks.begin();
+        if (it == free_blocks.end()) {
+            return false;
+        }
+        i = *it;
+        free_blocks.erase(it);
+        return true;
+    }
+
+    // takes a free slot below `bound` if any
+    template<class Tslots>
+    bool pop_below(Tidx bound, Tidx &i, Tslots &slots) {
+        auto it = free_blocks.begin();
+        if (it == free_blocks.end() || *it >= bound) {
+            return false;
+        }
+        return pop(i, slots);
+    }
+
+    template<class Tslots>
+    int pop_many(Tidx *out, int n, Tslots &slots) {
+        int k = 0;
+        while (k < n && pop(out[k], slots)) {
+            k++;
+        }
+        return k;
+    }
+
+    template<class Tslots>
+    void push(Tidx i, Tslots &) {
+        free_blocks.insert(i);
+    }
+
+    template<class Tslots>
+    void push_many(const Tidx *in, int n, Tslots &) {
+        free_blocks.insert(in, in + n);
+    }
+
+    // drops free slots from the end of [0, size)
+    void trim(Tidx &size) {
+        while (!free_blocks.empty()) {
+            auto last = std::prev(free_blocks.end());
+            if (*last != size-1) {
+                break;
+            }
+            free_blocks.erase(last);
+            size --;
+        }
+    }
+};
+
+/*
+ * Lock-free stack threaded through the free slots, LIFO reuse
+ * Head packs the top index with a modification tag against ABA
+ * */
+template<class Tidx>
+class FreeIndexStack {
+    static_assert(sizeof(Tidx) <= sizeof(uint32_t), "Index too wide");
+
+    // also masks the top index out of head, index (Tidx)-1 is reserved
+    constexpr static uint64_t NIL = (Tidx)-1;
+
+    uint64_t head = NIL;
+    size_t num_free = 0;
+
+    INLINE_WRAPPER
+    static uint64_t make_head(uint64_t prev, uint64_t top) {
+        return (((prev >> 32) + 1) << 32) | top;
+    }
+
+    // puts back the rest of a detached chain, walks it only on contention
+    template<class Tslots>
+    void push_chain(Tidx first, Tslots &slots) {
+        auto last = first;
+        bool at_tail = false;
+        auto h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        do {
+            if ((h & NIL) != NIL && !at_tail) {
+                while ((slots.link(last) & NIL) != NIL) {
+                    last = slots.link(last);
+                }
+                at_tail = true;
+            }
+            if (at_tail) {
+                __atomic_store_n(
+                    &slots.link(last), (Tidx)(h & NIL), __ATOMIC_RELAXED
+                );
+            }
+        } while (!__atomic_compare_exchange_n(
+            &head, &h, make_head(h, first), true,
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED
+        ));
+    }
+
+    public:
+    constexpr static bool needs_lock = false;
+
+    size_t count() {
+        return __atomic_load_n(&num_free, __ATOMIC_RELAXED);
+    }
+
+    template<class Tslots>
+    bool pop(Tidx &i, Tslots &slots) {
+        auto h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+        while (true) {
+            auto top = h & NIL;
+            if (top == NIL) {
+                return false;
+            }
+            // the link may be reused by now, the tag check then fails
+            auto next = __atomic_load_n(
+                &slots.link((Tidx)top), __ATOMIC_RELAXED
+            ) & NIL;
+            if (__atomic_compare_exchange_n(
+                &head, &h, make_head(h, next), true,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE
+            )) {
+                __atomic_fetch_sub(&num_free, 1, __ATOMIC_RELAXED);
+                i = (Tidx)top;
+                return true;
+            }
+        }
+    }
+
+    /*
+     * Pops up to n slots, returns their number
+     * Detaches the whole chain first: walking n links of the shared
+     * stack would follow slots other threads popped and filled,
+     * the detached chain is private. The rest goes back as one chain,
+     * popping threads meanwhile see an empty stack
+     * */
+    template<class Tslots>
+    int pop_many(Tidx *out, int n, Tslots &slots) {
+        if (n <= 1) {
+            return n == 1 ? pop(out[0], slots) : 0;
+        }
+        auto h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        do {
+            if ((h & NIL) == NIL) {
+                return 0;
+            }
+        } while (!__atomic_compare_exchange_n(
+            &head, &h, make_head(h, NIL), true,
+            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED
+        ));
+        int k = 0;
+        auto top = h & NIL;
+        while (k < n && top != NIL) {
+            out[k++] = (Tidx)top;
+            top = __atomic_load_n(
+                &slots.link((Tidx)top), __ATOMIC_RELAXED
+            ) & NIL;
+        }
+        __atomic_fetch_sub(&num_free, k, __ATOMIC_RELAXED);
+        if (top != NIL) {
+            push_chain((Tidx)top, slots);
+        }
+        return k;
+    }
+
+    template<class Tslots>
+    bool pop_below(Tidx bound, Tidx &i, Tslots &slots) {
+        if (!pop(i, slots)) {
+            return false;
+        }
+        if (i < bound) {
+            return true;
+        }
+        push(i, slots);
+        return false;
+    }
+
+    // pushes in[0..n) as one chain with a single CAS
+    template<class Tslots>
+    void push_many(const Tidx *in, int n, Tslots &slots) {
+        if (!n) {
+            return;
+        }
+        for (int k = 0; k + 1 < n; k++) {
+            __atomic_store_n(&slots.link(in[k]), in[k + 1], __ATOMIC_RELAXED);
+        }
+        auto h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        do {
+            __atomic_store_n(
+                &slots.link(in[n - 1]), (Tidx)(h & NIL), __ATOMIC_RELAXED
+            );
+        } while (!__atomic_compare_exchange_n(
+            &head, &h, make_head(h, in[0]), true,
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED
+        ));
+        __atomic_fetch_add(&num_free, n, __ATOMIC_RELAXED);
+    }
+
+    template<class Tslots>
+    void push(Tidx i, Tslots &slots) {
+        push_many(&i, 1, slots);
+    }
+
+    void trim(Tidx &) {}
+};
+
+/*
+ * Per thread magazines of free slots in front of FreeIndexStack
+ * Alloc / free touch only the calling thread magazine, it is refilled
+ * from / flushed to the shared stack by MAG_SIZE / 2 slots at once
+ * Slots are plain indices, so freeing on another thread is fine,
+ * the slot just lands in that thread magazine
+ * Magazines of exited threads are handed back as orphans
+ * */
+template<class Tidx, int MAG_SIZE = 64>
+class FreeIndexMagazine {
+    static_assert(MAG_SIZE >= 2, "Magazine too small");
+
+    constexpr static int BATCH = MAG_SIZE / 2;
+
+    struct Magazine {
+        FreeIndexMagazine *owner;
+        int n = 0;
+        Tidx idx[MAG_SIZE];
+    };
+
+    using Records = ThreadRecords<FreeIndexMagazine, Magazine>;
+    friend Records;
+
+    FreeIndexStack<Tidx> shared;
+
+    LockObject reg_lock;
+    std::vector<Magazine*> mags;
+    std::vector<Tidx> orphans;
+    size_t orphans_size = 0;
+
+    // thread exit, the slots go to orphans
+    void release(Magazine *m) {
+        auto l = reg_lock.lock();
+        orphans.insert(orphans.end(), m->idx, m->idx + m->n);
+        orphans_size = orphans.size();
+        mags.erase(std::find(mags.begin(), mags.end(), m));
+    }
+
+    void attach(Magazine *m) {
+        auto l = reg_lock.lock();
+        mags.push_back(m);
+    }
+
+    INLINE_WRAPPER
+    Magazine &magazine() {
+        return Records::get(this);
+    }
+
+    template<class Tslots>
+    RARE_FUNC
+    void refill(Magazine &m, Tslots &slots) {
+        m.n = shared.pop_many(m.idx, BATCH, slots);
+        if (m.n) {
+            return;
+        }
+        if (__atomic_load_n(&orphans_size, __ATOMIC_RELAXED)) {
+            auto l = reg_lock.lock();
+            while (m.n < BATCH && !orphans.empty()) {
+                m.idx[m.n++] = orphans.back();
+                orphans.pop_back();
+            }
+            orphans_size = orphans.size();
+            if (m.n) {
+                return;
+            }
+        }
+        auto first = slots.grow(BATCH);
+        // hand out the lowest one first
+        for (int k = BATCH - 1; k >= 0; k--) {
+            m.idx[m.n++] = first + k;
+        }
+    }
+
+    public:
+    constexpr static bool needs_lock = false;
+
+    FreeIndexMagazine() = default;
+    FreeIndexMagazine(const FreeIndexMagazine &) = delete;
+
+    ~FreeIndexMagazine() {
+        auto ld = Records::detach_lock().lock();
+        auto l = reg_lock.lock();
+        for (auto *m : mags) {
+            m->owner = NULL;
+        }
+    }
+
+    // slots held by magazines are not counted
+    size_t count() {
+        return shared.count();
+    }
+
+    template<class Tslots>
+    bool pop(Tidx &i, Tslots &slots) {
+        auto &m = magazine();
+        if (unlikely(!m.n)) {
+            refill(m, slots);
+        }
+        i = m.idx[--m.n];
+        return true;
+    }
+
+    // magazine first, the rest straight from the shared stack
+    template<class Tslots>
+    int pop_many(Tidx *out, int n, Tslots &slots) {
+        auto &m = magazine();
+        int k = std::min(n, m.n);
+        m.n -= k;
+        std::copy(m.idx + m.n, m.idx + m.n + k, out);
+        if (k < n) {
+            k += shared.pop_many(out + k, n - k, slots);
+        }
+        return k;
+    }
+
+    template<class Tslots>
+    bool pop_below(Tidx bound, Tidx &i, Tslots &slots) {
+        return shared.pop_below(bound, i, slots);
+    }
+
+    template<class Tslots>
+    void push(Tidx i, Tslots &slots) {
+        auto &m = magazine();
+        if (unlikely(m.n == MAG_SIZE)) {
+            m.n -= BATCH;
+            shared.push_many(m.idx + m.n, BATCH, slots);
+        }
+        m.idx[m.n++] = i;
+    }
+
+    // what does not fit the magazine goes to the shared stack as one chain
+    template<class Tslots>
+    void push_many(const Tidx *in, int n, Tslots &slots) {
+        auto &m = magazine();
+        int k = std::min(n, MAG_SIZE - m.n);
+        std::copy(in, in + k, m.idx + m.n);
+        m.n += k;
+        shared.push_many(in + k, n - k, slots);
+    }
+
+    void trim(Tidx &) {}
+};
+
+#endif /* __FREE_INDEX_H_ */
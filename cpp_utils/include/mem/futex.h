@@ -0,0 +1,79 @@
+#ifndef __FUTEX_H_
+#define __FUTEX_H_
+
+#include <utils/utils.h>
+
+#include <climits>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/*
+ * Raw futex helpers shared by the lock objects in mem/
+ * All of them operate on a plain int word, so any lock can expose its
+ * state word to another primitive ( e.g. condition variable requeue )
+ * */
+using futex_t = int;
+
+INLINE_WRAPPER
+int futex_call(
+    futex_t *uaddr, int futex_op, futex_t val,
+    const struct timespec *timeout = NULL,
+    futex_t *uaddr2 = NULL, int val3 = 0
+) {
+    return syscall(
+        SYS_futex, uaddr, futex_op, val,
+        timeout, uaddr2, val3
+    );
+}
+
+INLINE_WRAPPER
+int futex_wait(
+    futex_t *uaddr, futex_t val, const struct timespec *timeout = NULL
+) {
+    return futex_call(uaddr, FUTEX_WAIT_PRIVATE, val, timeout);
+}
+
+INLINE_WRAPPER
+int futex_wake(futex_t *uaddr, int n = 1) {
+    return futex_call(uaddr, FUTEX_WAKE_PRIVATE, n);
+}
+
+INLINE_WRAPPER
+int futex_wake_all(futex_t *uaddr) {
+    return futex_wake(uaddr, INT_MAX);
+}
+
+/* Bitset variants, wake only reaches waiters with overlapping bits */
+INLINE_WRAPPER
+int futex_wait_bitset(
+    futex_t *uaddr, futex_t val, unsigned int bitset,
+    const struct timespec *abs_timeout = NULL
+) {
+    return futex_call(
+        uaddr, FUTEX_WAIT_BITSET_PRIVATE, val, abs_timeout, NULL, bitset
+    );
+}
+
+INLINE_WRAPPER
+int futex_wake_bitset(futex_t *uaddr, unsigned int bitset, int n = INT_MAX) {
+    return futex_call(uaddr, FUTEX_WAKE_BITSET_PRIVATE, n, NULL, NULL, bitset);
+}
+
+INLINE_WRAPPER
+futex_t futex_load(futex_t *uaddr) {
+    return __atomic_load_n(uaddr, __ATOMIC_ACQUIRE);
+}
+
+INLINE_WRAPPER
+void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#else
+    asm volatile("" ::: "memory");
+#endif
+}
+
+#endif /* __FUTEX_H_ */
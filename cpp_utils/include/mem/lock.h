@@ -3,6 +3,8 @@
 
 #include <utils/utils.h>
 
+#include "lock_stats.h"
+
 template<class Tm, class Targ, bool movable = false>
 class ScopeLockArg { // TODO: move only object
     Tm *m;
@@ -79,86 +81,34 @@ class ScopeLock { // TODO: move only object
 
 #ifndef USE_PTHREAD
 
-#include <climits>
-#include <unistd.h>
-#include <sys/syscall.h>
-#include <linux/futex.h>
-
-#define COUNT_BRUTE_WAITERS
-#define BRUTE_WAIT_LIMIT 24
-#define BRUTE_WAITERS_COUNT 1
+#include "futex.h"
+#include "lock_policy.h"
 
 /*
  * Faster for rarely conflicts ( typical case )
  * Lower memory footprint
+ * WaitPolicy selects spinning before futex wait, see lock_policy.h
  * */
-class LockObject {
-    using futex_t = int;
-
+template<class WaitPolicy = BruteWaitPolicy>
+class BasicLockObject {
     futex_t _futex_var = 0;
     int num_futex_waiters = 0;
 
-#ifdef COUNT_BRUTE_WAITERS
-    int num_brute_waiters = 0;
-#else /* COUNT_BRUTE_WAITERS */
-    constexpr static int num_brute_waiters = 0;
-#endif /* COUNT_BRUTE_WAITERS */
-
-    inline int futex(
-        int futex_op, futex_t val,
-        const struct timespec *timeout, int *uaddr2, int val3
-    ) {
-        return syscall(
-            SYS_futex, &_futex_var, futex_op, val,
-            timeout, uaddr2, val3
-        );
-    }
-
-    inline void yield() {
-        syscall(SYS_sched_yield);
-    }
-
-    inline auto add_to_futex_waiters(int n) {
-        return __sync_add_and_fetch(&num_futex_waiters, n);
-    }
-
-    inline auto add_to_brute_waiters(int n) {
-#ifdef COUNT_BRUTE_WAITERS
-        return __sync_add_and_fetch(&num_brute_waiters, n);
-#else /* COUNT_BRUTE_WAITERS */
-        return num_brute_waiters;
-#endif /* COUNT_BRUTE_WAITERS */
-    }
+    WaitPolicy wait_policy;
 
     inline void futex_wait(futex_t start_val) {
-        add_to_futex_waiters(1);
-        futex(FUTEX_WAIT, start_val, NULL, NULL, 0);
-        add_to_futex_waiters(-1);
+        LOCK_STAT(lock_stats.futex_sleep());
+        __sync_add_and_fetch(&num_futex_waiters, 1);
+        ::futex_wait(&_futex_var, start_val);
+        __sync_add_and_fetch(&num_futex_waiters, -1);
     }
 
     inline auto atomic_try_lock() {
         return __sync_bool_compare_and_swap(&_futex_var, 0, 1);
     }
 
-    inline bool __brute_lock_wait(int limit=-1) {
-        add_to_brute_waiters(1);
-        do {
-            if (atomic_try_lock()) {
-                add_to_brute_waiters(-1);
-                return true;
-            }
-            yield();
-        } while (--limit);
-
-        add_to_brute_waiters(-1);
-        return false;
-    }
-
     void __lock_wait() {
-        if (
-            num_brute_waiters < BRUTE_WAITERS_COUNT
-            && __brute_lock_wait(BRUTE_WAIT_LIMIT)
-        ) {
+        if (wait_policy.spin_wait(*this)) {
             return;
         }
         while (!atomic_try_lock()) {
@@ -167,9 +117,18 @@ class LockObject {
     }
 
     public:
-    using lock_holder_t = ScopeLock<LockObject>;
+    using lock_holder_t = ScopeLock<BasicLockObject>;
+
+#ifdef LOCK_STATS
+    LockStats lock_stats;
+#endif /* LOCK_STATS */
+
+    void set_lock_name([[maybe_unused]] const std::string &name) {
+        LOCK_STAT(lock_stats.set_name(name));
+    }
 
     // MUST be used inside synchronized block
+    // notify between unlock and futex wait may be lost, see CondVar
     void wait() {
         ASSERT_DBG(locked(), "Object MUST be locked to use wait()");
         unlock_c();
@@ -179,7 +138,7 @@ class LockObject {
 
     auto notify(int n=1) {
         if (num_futex_waiters) {
-            return futex(FUTEX_WAKE, n, NULL, NULL, 0);
+            return futex_wake(&_futex_var, n);
         }
         return 0;
     }
@@ -189,18 +148,28 @@ class LockObject {
     }
 
     bool locked() {
-        return (bool)_futex_var;
+        return (bool)__atomic_load_n(&_futex_var, __ATOMIC_RELAXED);
+    }
+
+    bool try_lock_c() {
+        return atomic_try_lock();
     }
 
     void lock_c() {
         if (unlikely(!atomic_try_lock())) {
+            LOCK_STAT(auto wait_start = LockStats::now());
             __lock_wait();
+            LOCK_STAT(lock_stats.contended_acquired(wait_start));
         }
+        LOCK_STAT(lock_stats.acquired());
+        wait_policy.acquired();
     }
 
     void unlock_c() {
+        LOCK_STAT(lock_stats.released());
+        wait_policy.released();
         __sync_lock_release(&_futex_var);
-        if (!num_brute_waiters) {
+        if (wait_policy.should_notify()) {
             notify();
         }
     }
@@ -211,6 +180,9 @@ class LockObject {
     }
 };
 
+using LockObject = BasicLockObject<>;
+using AdaptiveLockObject = BasicLockObject<AdaptiveSpinPolicy<>>;
+
 #else /* ! USE_PTHREAD */
 
 #include <pthread.h>
@@ -222,13 +194,15 @@ class LockObject {
 
     public:
 
+    void set_lock_name(const std::string &) {}
+
     // MUST be used inside synchronized block
     void wait() {
         ASSERT_DBG(locked(), "Object MUST be locked to use wait()");
         pthread_cond_wait(&cond, &locker);
     }
 
-    void notify(int n=1) {
+    void notify(int = 1) {
         pthread_cond_signal(&cond);
     }
 
@@ -244,6 +218,10 @@ class LockObject {
         return true;
     }
 
+    bool try_lock_c() {
+        return !pthread_mutex_trylock(&locker);
+    }
+
     void lock_c() {
         pthread_mutex_lock(&locker);
     }
@@ -258,6 +236,10 @@ class LockObject {
     }
 };
 
+template<class WaitPolicy = void>
+using BasicLockObject = LockObject;
+using AdaptiveLockObject = LockObject;
+
 #endif /* ! USE_PTHREAD */
 
 #endif /* __LOCK_OBJ_H_ */
@@ -0,0 +1,116 @@
+#ifndef __LOCK_COMPACT_OBJ_H_
+#define __LOCK_COMPACT_OBJ_H_
+
+#include "lock.h"
+
+#ifndef USE_PTHREAD
+
+#include "futex.h"
+
+/*
+ * Whole state in one futex word:
+ *     0 - unlocked, 1 - locked, 2 - locked with ( possible ) waiters
+ * Uncontended lock is one CAS, uncontended unlock one exchange
+ * No wait() / notify(), use a separate condition for that
+ * */
+class CompactLockObject {
+    constexpr static futex_t UNLOCKED = 0;
+    constexpr static futex_t LOCKED = 1;
+    constexpr static futex_t CONTENDED = 2;
+
+    futex_t _futex_var = UNLOCKED;
+
+    inline auto atomic_try_lock() {
+        return __sync_bool_compare_and_swap(&_futex_var, UNLOCKED, LOCKED);
+    }
+
+    inline auto exchange(futex_t v) {
+        return __atomic_exchange_n(&_futex_var, v, __ATOMIC_ACQ_REL);
+    }
+
+    RARE_FUNC
+    void __lock_wait() {
+        auto state = futex_load(&_futex_var);
+        if (state != CONTENDED) {
+            state = exchange(CONTENDED);
+        }
+        while (state != UNLOCKED) {
+            LOCK_STAT(lock_stats.futex_sleep());
+            futex_wait(&_futex_var, CONTENDED);
+            state = exchange(CONTENDED);
+        }
+    }
+
+    public:
+    using lock_holder_t = ScopeLock<CompactLockObject>;
+
+#ifdef LOCK_STATS
+    LockStats lock_stats;
+#endif /* LOCK_STATS */
+
+    void set_lock_name([[maybe_unused]] const std::string &name) {
+        LOCK_STAT(lock_stats.set_name(name));
+    }
+
+    bool locked() {
+        return (bool)futex_load(&_futex_var);
+    }
+
+    bool try_lock_c() {
+        return atomic_try_lock();
+    }
+
+    void lock_c() {
+        if (unlikely(!atomic_try_lock())) {
+            LOCK_STAT(auto wait_start = LockStats::now());
+            __lock_wait();
+            LOCK_STAT(lock_stats.contended_acquired(wait_start));
+        }
+        LOCK_STAT(lock_stats.acquired());
+    }
+
+    /* Condition variable requeue support, see cond_var.h */
+    futex_t *futex_word() {
+        return &_futex_var;
+    }
+
+    // MUST be locked by the caller
+    void mark_contended() {
+        __atomic_store_n(&_futex_var, CONTENDED, __ATOMIC_RELAXED);
+    }
+
+    // keeps the word contended, so our unlock wakes the next waiter
+    void lock_contended_c() {
+        LOCK_STAT(auto wait_start = LockStats::now());
+        while (exchange(CONTENDED) != UNLOCKED) {
+            LOCK_STAT(lock_stats.futex_sleep());
+            futex_wait(&_futex_var, CONTENDED);
+        }
+        LOCK_STAT(lock_stats.contended_acquired(wait_start));
+        LOCK_STAT(lock_stats.acquired());
+    }
+
+    void unlock_c() {
+        LOCK_STAT(lock_stats.released());
+        if (unlikely(exchange(UNLOCKED) == CONTENDED)) {
+            futex_wake(&_futex_var);
+        }
+    }
+
+    INLINE_WRAPPER
+    auto lock() {
+        return ScopeLock(*this);
+    }
+};
+
+#ifndef LOCK_STATS
+static_assert(sizeof(CompactLockObject) == 4, "Compact lock must fit in 4 bytes");
+#endif /* LOCK_STATS */
+
+#else /* ! USE_PTHREAD */
+
+using CompactLockObject = LockObject;
+
+#endif /* ! USE_PTHREAD */
+
+#endif /* __LOCK_COMPACT_OBJ_H_ */
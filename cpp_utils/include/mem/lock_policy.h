@@ -0,0 +1,182 @@
+#ifndef __LOCK_POLICY_H_
+#define __LOCK_POLICY_H_
+
+#include <utils/utils.h>
+
+#include <cstdint>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "futex.h"
+#include "lock_stats.h"
+
+#define COUNT_BRUTE_WAITERS
+#define BRUTE_WAIT_LIMIT 24
+#define BRUTE_WAITERS_COUNT 1
+
+/*
+ * Wait policies decide what a lock does before it parks on the futex
+ *     spin_wait(l) - try to take `l` without sleeping, true on success
+ *     should_notify() - unlock has to wake futex sleepers
+ *     acquired() / released() - called with the lock held
+ * Policy object is a member of each lock, so its state is per lock
+ * */
+
+INLINE_WRAPPER
+uint64_t cycle_clock() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec tm;
+    clock_gettime(CLOCK_MONOTONIC, &tm);
+    return ((uint64_t)tm.tv_sec) * 1000000000 + tm.tv_nsec;
+#endif
+}
+
+inline bool single_cpu() {
+    static const bool r = sysconf(_SC_NPROCESSORS_ONLN) <= 1;
+    return r;
+}
+
+/*
+ * Original LockObject behaviour:
+ * up to BRUTE_WAITERS_COUNT threads yield BRUTE_WAIT_LIMIT times
+ * */
+class BruteWaitPolicy {
+#ifdef COUNT_BRUTE_WAITERS
+    int num_brute_waiters = 0;
+#else /* COUNT_BRUTE_WAITERS */
+    constexpr static int num_brute_waiters = 0;
+#endif /* COUNT_BRUTE_WAITERS */
+
+    inline void yield() {
+        syscall(SYS_sched_yield);
+    }
+
+    inline auto add_to_brute_waiters(int n) {
+#ifdef COUNT_BRUTE_WAITERS
+        return __sync_add_and_fetch(&num_brute_waiters, n);
+#else /* COUNT_BRUTE_WAITERS */
+        return num_brute_waiters;
+#endif /* COUNT_BRUTE_WAITERS */
+    }
+
+    template<class Tl>
+    inline bool __brute_lock_wait(Tl &l, int limit=-1) {
+        add_to_brute_waiters(1);
+        do {
+            if (l.try_lock_c()) {
+                add_to_brute_waiters(-1);
+                return true;
+            }
+            LOCK_STAT(l.lock_stats.spins(1));
+            yield();
+        } while (--limit);
+
+        add_to_brute_waiters(-1);
+        return false;
+    }
+
+    public:
+
+    template<class Tl>
+    bool spin_wait(Tl &l) {
+        return num_brute_waiters < BRUTE_WAITERS_COUNT
+            && __brute_lock_wait(l, BRUTE_WAIT_LIMIT);
+    }
+
+    bool should_notify() {
+        return !num_brute_waiters;
+    }
+
+    void acquired() {}
+    void released() {}
+};
+
+/*
+ * Spins with cpu pause for about as long as the lock is usually held
+ * Hold time is a moving average ( 1/8 weight ) in cycle_clock() ticks
+ * On single cpu machines spinning is replaced by a few yields
+ * */
+template<
+    uint32_t PAUSE_TICKS = 40,
+    uint32_t MIN_SPINS = 16, uint32_t MAX_SPINS = 16384
+>
+class AdaptiveSpinPolicy {
+    constexpr static int64_t MAX_HOLD_TICKS = (int64_t)PAUSE_TICKS * MAX_SPINS * 4;
+    constexpr static uint32_t SINGLE_CPU_YIELDS = BRUTE_WAIT_LIMIT;
+    // hold time is sampled on every SAMPLE_MASK+1 -th acquire
+    constexpr static uint32_t SAMPLE_MASK = 7;
+
+    uint32_t hold_ticks = PAUSE_TICKS * MIN_SPINS;
+    uint32_t acquire_count = 0;
+    uint64_t acquire_ts = 0;
+
+    inline uint32_t spin_limit() {
+        auto spins = __atomic_load_n(&hold_ticks, __ATOMIC_RELAXED) / PAUSE_TICKS * 2;
+        if (spins < MIN_SPINS) {
+            return MIN_SPINS;
+        }
+        if (spins > MAX_SPINS) {
+            return MAX_SPINS;
+        }
+        return spins;
+    }
+
+    public:
+
+    template<class Tl>
+    bool spin_wait(Tl &l) {
+        if (single_cpu()) {
+            // spinning can't help, let the holder run instead
+            for (uint32_t i = 0; i < SINGLE_CPU_YIELDS; i++) {
+                LOCK_STAT(l.lock_stats.spins(1));
+                syscall(SYS_sched_yield);
+                if (l.try_lock_c()) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        auto limit = spin_limit();
+        for (uint32_t i = 0; i < limit; i++) {
+            if (!l.locked() && l.try_lock_c()) {
+                LOCK_STAT(l.lock_stats.spins(i));
+                return true;
+            }
+            cpu_relax();
+        }
+        LOCK_STAT(l.lock_stats.spins(limit));
+        return false;
+    }
+
+    bool should_notify() {
+        return true;
+    }
+
+    void acquired() {
+        if (!(++acquire_count & SAMPLE_MASK)) {
+            acquire_ts = cycle_clock();
+        }
+    }
+
+    void released() {
+        if (acquire_count & SAMPLE_MASK) {
+            return;
+        }
+        int64_t hold = cycle_clock() - acquire_ts;
+        if (unlikely(hold > MAX_HOLD_TICKS)) {
+            hold = MAX_HOLD_TICKS;
+        }
+        int64_t avg = hold_ticks;
+        __atomic_store_n(
+            &hold_ticks, (uint32_t)(avg + ((hold - avg) >> 3)), __ATOMIC_RELAXED
+        );
+    }
+};
+
+#endif /* __LOCK_POLICY_H_ */
@@ -1,28 +1,147 @@
 #ifndef __POOL_LOCK_H_
 #define __POOL_LOCK_H_
 
+#include <algorithm>
+#include <array>
+#include <vector>
+
 #include "lock.h"
 
-template<class To, int N>
+template<class To>
+struct PoolLockHash {
+    INLINE_WRAPPER
+    size_t operator()(const To &v) const {
+        return ((size_t)v) * 74675675667;
+    }
+};
+
+/*
+ * Holds several locks taken in ascending stripe order
+ * Tptrs is std::array or std::vector of lock pointers
+ * */
+template<class Tm, class Tptrs>
+class MultiScopeLock {
+    Tptrs m;
+    int n;
+
+    public:
+        MultiScopeLock(const MultiScopeLock &) = delete;
+
+        MultiScopeLock(Tptrs ptrs, int n)
+            : m(ptrs), n(n) {
+            for (int i = 0; i < n; i++) {
+                m[i]->lock_c();
+            }
+        }
+
+        ~MultiScopeLock() {
+            for (int i = n - 1; i >= 0; i--) {
+                m[i]->unlock_c();
+            }
+        }
+};
+
+/*
+ * Hashed lock stripes, one cache line each
+ * Stripe count defaults to N and can be changed with resize()
+ * */
+template<
+    class To, int N, class Tlock = LockObject,
+    class Thash = PoolLockHash<To>
+>
 class PoolLock {
-    LockObject L[N];
+    std::vector<CachePadded<Tlock>> L;
+    Thash hasher;
 
-    inline int hash(To &v) {
-        return (v * 74675675667) % N;
+    template<class Tidx>
+    inline int sort_unique(Tidx &idx, int n) {
+        std::sort(idx.begin(), idx.begin() + n);
+        return std::unique(idx.begin(), idx.begin() + n) - idx.begin();
     }
 
     public:
-        auto &get_locker(To &v) {
-            auto h = hash(v);
-            return L[h];
+        using lock_t = Tlock;
+
+        PoolLock(int n = N)
+            : L(n) {}
+
+        int size() {
+            return L.size();
+        }
+
+        // MUST NOT be called while any stripe is held or in use
+        void resize(int n) {
+            for (auto &l : L) {
+                ASSERT(!l.v.locked(), "Resizing pool with a held lock");
+            }
+            std::vector<CachePadded<Tlock>>(n).swap(L);
         }
 
-        auto lock(To &v) {
+        inline int index(const To &v) {
+            return hasher(v) % L.size();
+        }
+
+        auto &get_locker(const To &v) {
+            return L[index(v)].v;
+        }
+
+        auto lock(const To &v) {
             return ScopeLock(
                 get_locker(v)
             );
         }
+
+        // deadlock free locking of many keys, each stripe is taken once
+        template<class ... Tkeys>
+        auto lock_many(const Tkeys& ...keys) {
+            constexpr int K = sizeof...(Tkeys);
+            std::array<int, K> idx = {index(keys)...};
+            int n = sort_unique(idx, K);
+
+            std::array<Tlock*, K> ptrs;
+            for (int i = 0; i < n; i++) {
+                ptrs[i] = &L[idx[i]].v;
+            }
+            return MultiScopeLock<Tlock, std::array<Tlock*, K>>(ptrs, n);
+        }
+
+        // stripes are marked, not sorted, so long ranges stay linear
+        template<class Tit>
+        auto lock_range(Tit begin, Tit end) {
+            std::vector<char> used(L.size(), 0);
+            for (auto it = begin; it != end; ++it) {
+                used[index(*it)] = 1;
+            }
+
+            std::vector<Tlock*> ptrs;
+            for (size_t i = 0; i < L.size(); i++) {
+                if (used[i]) {
+                    ptrs.push_back(&L[i].v);
+                }
+            }
+            int n = ptrs.size();
+            return MultiScopeLock<Tlock, std::vector<Tlock*>>(
+                std::move(ptrs), n
+            );
+        }
+
+        // every stripe, e.g. to stop all users of the pool
+        auto lock_all() {
+            std::vector<Tlock*> ptrs(L.size());
+            for (size_t i = 0; i < L.size(); i++) {
+                ptrs[i] = &L[i].v;
+            }
+            return MultiScopeLock<Tlock, std::vector<Tlock*>>(
+                std::move(ptrs), L.size()
+            );
+        }
+
+        // stripes are named `name[i]`
+        void set_lock_name(const std::string &name) {
+            for (size_t i = 0; i < L.size(); i++) {
+                L[i].v.set_lock_name(name + "[" + std::to_string(i) + "]");
+            }
+        }
 };
 
 #endif /* __POOL_LOCK_H_ */
-
@@ -0,0 +1,234 @@
+#ifndef __LOCK_QUEUE_OBJ_H_
+#define __LOCK_QUEUE_OBJ_H_
+
+#include "lock.h"
+#include "lock_policy.h"
+#include "futex.h"
+
+/*
+ * Fair ( FIFO ) locks with the LockObject interface
+ * Waiters spin for QUEUE_LOCK_SPINS rounds, then park on a futex
+ * */
+#define QUEUE_LOCK_SPINS 256
+
+INLINE_WRAPPER
+void queue_lock_relax() {
+    if (single_cpu()) {
+        syscall(SYS_sched_yield);
+    } else {
+        cpu_relax();
+    }
+}
+
+/*
+ * Threads are served in ticket order
+ * Unlock has to wake all parked waiters, only one of them proceeds,
+ * so keep critical sections short or use MCSLock under heavy contention
+ * */
+class TicketLock {
+    futex_t now_serving = 0;
+    futex_t next_ticket = 0;
+    int num_futex_waiters = 0;
+
+    RARE_FUNC
+    void __lock_wait(futex_t ticket) {
+        int spins = 0;
+        futex_t cur;
+        while ((cur = futex_load(&now_serving)) != ticket) {
+            if (spins < QUEUE_LOCK_SPINS) {
+                spins++;
+                queue_lock_relax();
+            } else {
+                LOCK_STAT(lock_stats.futex_sleep());
+                __sync_add_and_fetch(&num_futex_waiters, 1);
+                futex_wait(&now_serving, cur);
+                __sync_add_and_fetch(&num_futex_waiters, -1);
+            }
+        }
+        LOCK_STAT(lock_stats.spins(spins));
+    }
+
+    public:
+    using lock_holder_t = ScopeLock<TicketLock>;
+
+#ifdef LOCK_STATS
+    LockStats lock_stats;
+#endif /* LOCK_STATS */
+
+    void set_lock_name([[maybe_unused]] const std::string &name) {
+        LOCK_STAT(lock_stats.set_name(name));
+    }
+
+    bool locked() {
+        return futex_load(&now_serving) != futex_load(&next_ticket);
+    }
+
+    bool try_lock_c() {
+        auto t = futex_load(&now_serving);
+        return __sync_bool_compare_and_swap(&next_ticket, t, t + 1);
+    }
+
+    void lock_c() {
+        auto ticket = __sync_fetch_and_add(&next_ticket, 1);
+        if (unlikely(futex_load(&now_serving) != ticket)) {
+            LOCK_STAT(auto wait_start = LockStats::now());
+            __lock_wait(ticket);
+            LOCK_STAT(lock_stats.contended_acquired(wait_start));
+        }
+        LOCK_STAT(lock_stats.acquired());
+    }
+
+    void unlock_c() {
+        LOCK_STAT(lock_stats.released());
+        // full barrier, the waiter count is checked after the release
+        // is visible, pairs with the increment before futex_wait()
+        __atomic_fetch_add(&now_serving, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&num_futex_waiters, __ATOMIC_SEQ_CST)) {
+            futex_wake_all(&now_serving);
+        }
+    }
+
+    INLINE_WRAPPER
+    auto lock() {
+        return ScopeLock(*this);
+    }
+};
+
+/*
+ * MCS queue lock, each waiter spins / parks on its own node
+ * Nodes come from a per thread free list, the holder node is kept
+ * in the lock, so lock_c() / unlock_c() need no extra argument
+ * */
+class MCSLock {
+    struct Node {
+        constexpr static futex_t GRANTED = 0;
+        constexpr static futex_t WAITING = 1;
+        constexpr static futex_t PARKED = 2;
+
+        Node *next;
+        futex_t state;
+    };
+
+    struct NodePool {
+        Node *free_list = NULL;
+
+        Node *get() {
+            auto *n = free_list;
+            if (likely(n)) {
+                free_list = n->next;
+                return n;
+            }
+            return new Node();
+        }
+
+        void put(Node *n) {
+            n->next = free_list;
+            free_list = n;
+        }
+
+        ~NodePool() {
+            while (free_list) {
+                auto *n = free_list;
+                free_list = n->next;
+                delete n;
+            }
+        }
+    };
+
+    static NodePool &node_pool() {
+        static thread_local NodePool pool;
+        return pool;
+    }
+
+    Node *tail = NULL;
+    Node *owner = NULL;
+
+    RARE_FUNC
+    void __lock_wait(Node *node) {
+        int spins = 0;
+        while (futex_load(&node->state) != Node::GRANTED) {
+            if (spins < QUEUE_LOCK_SPINS) {
+                spins++;
+                queue_lock_relax();
+            } else if (__sync_bool_compare_and_swap(
+                &node->state, Node::WAITING, Node::PARKED
+            ) || futex_load(&node->state) == Node::PARKED) {
+                LOCK_STAT(lock_stats.futex_sleep());
+                futex_wait(&node->state, Node::PARKED);
+            }
+        }
+        LOCK_STAT(lock_stats.spins(spins));
+    }
+
+    public:
+    using lock_holder_t = ScopeLock<MCSLock>;
+
+#ifdef LOCK_STATS
+    LockStats lock_stats;
+#endif /* LOCK_STATS */
+
+    void set_lock_name([[maybe_unused]] const std::string &name) {
+        LOCK_STAT(lock_stats.set_name(name));
+    }
+
+    bool locked() {
+        return __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+    }
+
+    bool try_lock_c() {
+        auto *node = node_pool().get();
+        node->next = NULL;
+        node->state = Node::GRANTED;
+        if (__sync_bool_compare_and_swap(&tail, (Node*)NULL, node)) {
+            owner = node;
+            return true;
+        }
+        node_pool().put(node);
+        return false;
+    }
+
+    void lock_c() {
+        auto *node = node_pool().get();
+        node->next = NULL;
+        node->state = Node::WAITING;
+
+        auto *pred = __atomic_exchange_n(&tail, node, __ATOMIC_ACQ_REL);
+        if (unlikely(pred)) {
+            LOCK_STAT(auto wait_start = LockStats::now());
+            __atomic_store_n(&pred->next, node, __ATOMIC_RELEASE);
+            __lock_wait(node);
+            LOCK_STAT(lock_stats.contended_acquired(wait_start));
+        }
+        owner = node;
+        LOCK_STAT(lock_stats.acquired());
+    }
+
+    void unlock_c() {
+        LOCK_STAT(lock_stats.released());
+        auto *node = owner;
+        auto *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+        if (!next) {
+            if (__sync_bool_compare_and_swap(&tail, node, (Node*)NULL)) {
+                node_pool().put(node);
+                return;
+            }
+            // successor is between tail exchange and linking
+            while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE))) {
+                cpu_relax();
+            }
+        }
+        if (__atomic_exchange_n(
+            &next->state, Node::GRANTED, __ATOMIC_ACQ_REL
+        ) == Node::PARKED) {
+            futex_wake(&next->state);
+        }
+        node_pool().put(node);
+    }
+
+    INLINE_WRAPPER
+    auto lock() {
+        return ScopeLock(*this);
+    }
+};
+
+#endif /* __LOCK_QUEUE_OBJ_H_ */
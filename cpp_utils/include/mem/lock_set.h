@@ -1,36 +1,84 @@
 #ifndef __LOCK_SET_OBJ_H_
 #define __LOCK_SET_OBJ_H_
 
+#include <functional>
 #include <unordered_set>
 
 #include "lock.h"
+#include "futex.h"
 
-template<class To>
-class SetLock : LockObject {
-    std::unordered_set<To> lock_set;
+/*
+ * Keyed lock, keys are spread over SHARDS independent shards
+ * Each shard has its own guard, key set and futex word,
+ * waiters additionally select one of 32 futex bitset bits by key hash,
+ * so unlock wakes only threads waiting for ( nearly ) the same key
+ * Tlock guards a shard key set only, any lock type works here
+ * */
+template<
+    class To, class Tlock = LockObject, int SHARDS = 64,
+    class Thash = std::hash<To>
+>
+class SetLock {
+    struct Shard {
+        Tlock set_lock;
+        futex_t wait_seq = 0;
+        int num_waiters = 0;
+        std::unordered_set<To, Thash> lock_set;
+    };
+
+    CachePadded<Shard> shards[SHARDS];
+    Thash hasher;
+
+    inline auto &get_shard(size_t h) {
+        return shards[h % SHARDS].v;
+    }
+
+    inline unsigned int wake_bit(size_t h) {
+        return 1u << ((h / SHARDS) & 31);
+    }
 
     public:
-        void lock_c(To &v) {
-            auto l = LockObject::lock();
-            while (lock_set.find(v) != lock_set.end()) {
-                wait();
+        void set_lock_name(const std::string &name) {
+            for (int i = 0; i < SHARDS; i++) {
+                shards[i].v.set_lock.set_lock_name(
+                    name + "[" + std::to_string(i) + "]"
+                );
+            }
+        }
+
+        void lock_c(const To &v) {
+            auto h = hasher(v);
+            auto &s = get_shard(h);
+            s.set_lock.lock_c();
+            while (s.lock_set.find(v) != s.lock_set.end()) {
+                auto seq = futex_load(&s.wait_seq);
+                __sync_add_and_fetch(&s.num_waiters, 1);
+                s.set_lock.unlock_c();
+                futex_wait_bitset(&s.wait_seq, seq, wake_bit(h));
+                __sync_add_and_fetch(&s.num_waiters, -1);
+                s.set_lock.lock_c();
             }
-            lock_set.insert(v);
+            s.lock_set.insert(v);
+            s.set_lock.unlock_c();
         }
 
-        void unlock_c(To &v) {
+        void unlock_c(const To &v) {
+            auto h = hasher(v);
+            auto &s = get_shard(h);
             { // scope for lock
-                auto l = LockObject::lock();
-                lock_set.erase(v);
+                auto l = s.set_lock.lock();
+                s.lock_set.erase(v);
+                __sync_add_and_fetch(&s.wait_seq, 1);
+            }
+            if (__atomic_load_n(&s.num_waiters, __ATOMIC_ACQUIRE)) {
+                futex_wake_bitset(&s.wait_seq, wake_bit(h));
             }
-            notifyAll(); // All ?
         }
 
         INLINE_WRAPPER
-        auto lock(To &v) {
+        auto lock(const To &v) {
             return ScopeLockArg(*this, v);
         }
 };
 
 #endif /* __LOCK_SET_OBJ_H_ */
-
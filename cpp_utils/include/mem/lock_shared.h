@@ -0,0 +1,222 @@
+#ifndef __LOCK_SHARED_OBJ_H_
+#define __LOCK_SHARED_OBJ_H_
+
+#include "lock.h"
+
+template<class Tm>
+class ScopeSharedLock {
+    Tm *m;
+
+    public:
+        ScopeSharedLock(const ScopeSharedLock &) = delete;
+
+        INLINE_WRAPPER
+        ScopeSharedLock(Tm &_m)
+            : m(&_m) {
+            m->lock_shared_c();
+        }
+
+        INLINE_WRAPPER
+        ~ScopeSharedLock() {
+            m->unlock_shared_c();
+        }
+};
+
+#ifndef USE_PTHREAD
+
+#include "futex.h"
+
+/*
+ * Reader-writer lock on a single futex word
+ * Low bits count readers, top bit marks the writer
+ * Readers back off while any writer is waiting ( writer preference )
+ * */
+class SharedLockObject {
+    constexpr static futex_t WRITER_BIT = INT_MIN;
+
+    futex_t _futex_var = 0;
+    int num_writers_waiting = 0;
+    int num_futex_waiters = 0;
+
+    inline void futex_wait_state(futex_t state) {
+        LOCK_STAT(lock_stats.futex_sleep());
+        __sync_add_and_fetch(&num_futex_waiters, 1);
+        futex_wait(&_futex_var, state);
+        __sync_add_and_fetch(&num_futex_waiters, -1);
+    }
+
+    // callers MUST release with a full barrier, pairs with the
+    // waiter count increment before futex_wait()
+    inline void notify_all() {
+        if (__atomic_load_n(&num_futex_waiters, __ATOMIC_SEQ_CST)) {
+            futex_wake_all(&_futex_var);
+        }
+    }
+
+    inline bool try_lock_shared_state(futex_t state) {
+        return !(state & WRITER_BIT)
+            && !__atomic_load_n(&num_writers_waiting, __ATOMIC_ACQUIRE)
+            && __sync_bool_compare_and_swap(&_futex_var, state, state + 1);
+    }
+
+    RARE_FUNC
+    void __lock_shared_wait() {
+        while (true) {
+            auto state = futex_load(&_futex_var);
+            if (try_lock_shared_state(state)) {
+                return;
+            }
+            if (
+                (state & WRITER_BIT)
+                || __atomic_load_n(&num_writers_waiting, __ATOMIC_ACQUIRE)
+            ) {
+                futex_wait_state(state);
+            }
+        }
+    }
+
+    RARE_FUNC
+    void __lock_wait() {
+        __sync_add_and_fetch(&num_writers_waiting, 1);
+        while (true) {
+            if (__sync_bool_compare_and_swap(&_futex_var, 0, WRITER_BIT)) {
+                break;
+            }
+            auto state = futex_load(&_futex_var);
+            if (state) {
+                futex_wait_state(state);
+            }
+        }
+        __sync_add_and_fetch(&num_writers_waiting, -1);
+    }
+
+    public:
+    using lock_holder_t = ScopeLock<SharedLockObject>;
+    using shared_lock_holder_t = ScopeSharedLock<SharedLockObject>;
+
+#ifdef LOCK_STATS
+    // hold times are tracked for the exclusive side only
+    LockStats lock_stats;
+#endif /* LOCK_STATS */
+
+    void set_lock_name([[maybe_unused]] const std::string &name) {
+        LOCK_STAT(lock_stats.set_name(name));
+    }
+
+    bool locked() {
+        return (bool)futex_load(&_futex_var);
+    }
+
+    bool locked_exclusive() {
+        return futex_load(&_futex_var) & WRITER_BIT;
+    }
+
+    bool try_lock_c() {
+        if (!__sync_bool_compare_and_swap(&_futex_var, 0, WRITER_BIT)) {
+            return false;
+        }
+        LOCK_STAT(lock_stats.acquired());
+        return true;
+    }
+
+    void lock_c() {
+        if (unlikely(!__sync_bool_compare_and_swap(&_futex_var, 0, WRITER_BIT))) {
+            LOCK_STAT(auto wait_start = LockStats::now());
+            __lock_wait();
+            LOCK_STAT(lock_stats.contended_acquired(wait_start));
+        }
+        LOCK_STAT(lock_stats.acquired());
+    }
+
+    void unlock_c() {
+        LOCK_STAT(lock_stats.released());
+        __atomic_exchange_n(&_futex_var, 0, __ATOMIC_SEQ_CST);
+        notify_all();
+    }
+
+    void lock_shared_c() {
+        if (unlikely(!try_lock_shared_state(futex_load(&_futex_var)))) {
+            LOCK_STAT(auto wait_start = LockStats::now());
+            __lock_shared_wait();
+            LOCK_STAT(lock_stats.contended_acquired(wait_start));
+        }
+        LOCK_STAT(lock_stats.shared_acquired());
+    }
+
+    void unlock_shared_c() {
+        if (__sync_sub_and_fetch(&_futex_var, 1) == 0) {
+            notify_all();
+        }
+    }
+
+    INLINE_WRAPPER
+    auto lock() {
+        return ScopeLock(*this);
+    }
+
+    INLINE_WRAPPER
+    auto lock_shared() {
+        return ScopeSharedLock(*this);
+    }
+};
+
+#else /* ! USE_PTHREAD */
+
+#include <pthread.h>
+
+/* compatibility pthread version */
+class SharedLockObject {
+    pthread_rwlock_t locker;
+
+    public:
+
+    SharedLockObject() {
+        pthread_rwlockattr_t attr;
+        pthread_rwlockattr_init(&attr);
+        pthread_rwlockattr_setkind_np(
+            &attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP
+        );
+        pthread_rwlock_init(&locker, &attr);
+        pthread_rwlockattr_destroy(&attr);
+    }
+
+    ~SharedLockObject() {
+        pthread_rwlock_destroy(&locker);
+    }
+
+    void set_lock_name(const std::string &) {}
+
+    bool try_lock_c() {
+        return !pthread_rwlock_trywrlock(&locker);
+    }
+
+    void lock_c() {
+        pthread_rwlock_wrlock(&locker);
+    }
+
+    void unlock_c() {
+        pthread_rwlock_unlock(&locker);
+    }
+
+    void lock_shared_c() {
+        pthread_rwlock_rdlock(&locker);
+    }
+
+    void unlock_shared_c() {
+        pthread_rwlock_unlock(&locker);
+    }
+
+    INLINE_WRAPPER
+    auto lock() {
+        return ScopeLock(*this);
+    }
+
+    INLINE_WRAPPER
+    auto lock_shared() {
+        return ScopeSharedLock(*this);
+    }
+};
+
+#endif /* ! USE_PTHREAD */
+
+#endif /* __LOCK_SHARED_OBJ_H_ */
@@ -0,0 +1,225 @@
+#ifndef __LOCK_STATS_H_
+#define __LOCK_STATS_H_
+
+#include <utils/utils.h>
+
+#include <string>
+
+/*
+ * Opt-in lock contention counters, build with -DLOCK_STATS
+ * Without it LOCK_STAT(...) expands to nothing and locks carry no extra state
+ * */
+#ifdef LOCK_STATS
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <sstream>
+#include <unordered_set>
+#include <vector>
+#include <time.h>
+
+#define LOCK_STAT(...) __VA_ARGS__
+
+class LockStats;
+
+struct LockStatsSnapshot {
+    constexpr static int HIST_BUCKETS = 32;
+
+    std::string name;
+    uint64_t acquisitions = 0;
+    uint64_t contended = 0;
+    uint64_t futex_sleeps = 0;
+    uint64_t spin_iterations = 0;
+    // log2 of nanoseconds
+    uint64_t hold_hist[HIST_BUCKETS] = {};
+    uint64_t wait_hist[HIST_BUCKETS] = {};
+
+    static uint64_t hist_percentile(const uint64_t *hist, double p) {
+        uint64_t total = 0;
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+            total += hist[i];
+        }
+        if (!total) {
+            return 0;
+        }
+        uint64_t target = total * p, seen = 0;
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+            seen += hist[i];
+            if (seen > target) {
+                return ((uint64_t)1) << i;
+            }
+        }
+        return ((uint64_t)1) << (HIST_BUCKETS - 1);
+    }
+};
+
+class LockStatsRegistry {
+    std::mutex m;
+    std::unordered_set<LockStats*> stats;
+
+    public:
+
+    void add(LockStats *s) {
+        std::lock_guard<std::mutex> l(m);
+        stats.insert(s);
+    }
+
+    void remove(LockStats *s) {
+        std::lock_guard<std::mutex> l(m);
+        stats.erase(s);
+    }
+
+    // most contended first
+    std::vector<LockStatsSnapshot> top(int n);
+
+    std::string dump(int n);
+
+    static LockStatsRegistry &get() {
+        // never destroyed, static locks unregister after main() returns
+        static auto *r = new LockStatsRegistry();
+        return *r;
+    }
+};
+
+class LockStats {
+    LockStatsSnapshot s;
+    uint64_t acquire_ts = 0;
+
+    template<class T>
+    static void add(T &v, T n) {
+        __atomic_fetch_add(&v, n, __ATOMIC_RELAXED);
+    }
+
+    static int hist_bucket(uint64_t ns) {
+        if (!ns) {
+            return 0;
+        }
+        auto b = 64 - __builtin_clzll(ns);
+        return std::min(b, LockStatsSnapshot::HIST_BUCKETS - 1);
+    }
+
+    public:
+
+    LockStats() {
+        LockStatsRegistry::get().add(this);
+    }
+
+    LockStats(const LockStats &) : LockStats() {}
+
+    LockStats &operator=(const LockStats &) {
+        return *this;
+    }
+
+    ~LockStats() {
+        LockStatsRegistry::get().remove(this);
+    }
+
+    static uint64_t now() {
+        struct timespec tm;
+        clock_gettime(CLOCK_MONOTONIC, &tm);
+        return ((uint64_t)tm.tv_sec) * 1000000000 + tm.tv_nsec;
+    }
+
+    void set_name(const std::string &name) {
+        s.name = name;
+    }
+
+    void acquired() {
+        add(s.acquisitions, (uint64_t)1);
+        acquire_ts = now();
+    }
+
+    void shared_acquired() {
+        add(s.acquisitions, (uint64_t)1);
+    }
+
+    void contended_acquired(uint64_t wait_start) {
+        add(s.contended, (uint64_t)1);
+        add(s.wait_hist[hist_bucket(now() - wait_start)], (uint64_t)1);
+    }
+
+    void released() {
+        add(s.hold_hist[hist_bucket(now() - acquire_ts)], (uint64_t)1);
+    }
+
+    void futex_sleep() {
+        add(s.futex_sleeps, (uint64_t)1);
+    }
+
+    void spins(uint64_t n) {
+        add(s.spin_iterations, n);
+    }
+
+    // counters are updated concurrently, read each one atomically
+    LockStatsSnapshot snapshot() const {
+        LockStatsSnapshot r;
+        r.name = s.name;
+        r.acquisitions = __atomic_load_n(&s.acquisitions, __ATOMIC_RELAXED);
+        r.contended = __atomic_load_n(&s.contended, __ATOMIC_RELAXED);
+        r.futex_sleeps = __atomic_load_n(&s.futex_sleeps, __ATOMIC_RELAXED);
+        r.spin_iterations = __atomic_load_n(
+            &s.spin_iterations, __ATOMIC_RELAXED
+        );
+        for (int i = 0; i < LockStatsSnapshot::HIST_BUCKETS; i++) {
+            r.hold_hist[i] = __atomic_load_n(&s.hold_hist[i], __ATOMIC_RELAXED);
+            r.wait_hist[i] = __atomic_load_n(&s.wait_hist[i], __ATOMIC_RELAXED);
+        }
+        if (r.name.empty()) {
+            std::ostringstream os;
+            os << "lock@" << (const void*)this;
+            r.name = os.str();
+        }
+        return r;
+    }
+};
+
+inline std::vector<LockStatsSnapshot> LockStatsRegistry::top(int n) {
+    std::vector<LockStatsSnapshot> r;
+    {
+        std::lock_guard<std::mutex> l(m);
+        r.reserve(stats.size());
+        for (auto *s : stats) {
+            r.push_back(s->snapshot());
+        }
+    }
+    std::sort(r.begin(), r.end(), [](auto &a, auto &b) {
+        return a.contended > b.contended;
+    });
+    if (n >= 0 && (size_t)n < r.size()) {
+        r.resize(n);
+    }
+    return r;
+}
+
+inline std::string LockStatsRegistry::dump(int n) {
+    std::ostringstream os;
+    os << "name acquisitions contended futex_sleeps spins"
+       << " wait_p50_ns wait_p99_ns hold_p50_ns hold_p99_ns\n";
+    for (auto &s : top(n)) {
+        os << s.name << " " << s.acquisitions << " " << s.contended
+           << " " << s.futex_sleeps << " " << s.spin_iterations
+           << " " << LockStatsSnapshot::hist_percentile(s.wait_hist, 0.5)
+           << " " << LockStatsSnapshot::hist_percentile(s.wait_hist, 0.99)
+           << " " << LockStatsSnapshot::hist_percentile(s.hold_hist, 0.5)
+           << " " << LockStatsSnapshot::hist_percentile(s.hold_hist, 0.99)
+           << "\n";
+    }
+    return os.str();
+}
+
+inline std::string lock_stats_dump(int n = 16) {
+    return LockStatsRegistry::get().dump(n);
+}
+
+#else /* LOCK_STATS */
+
+#define LOCK_STAT(...)
+
+inline std::string lock_stats_dump(int = 16) {
+    return "lock stats disabled, build with -DLOCK_STATS\n";
+}
+
+#endif /* LOCK_STATS */
+
+#endif /* __LOCK_STATS_H_ */
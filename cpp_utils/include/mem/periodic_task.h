@@ -0,0 +1,66 @@
+#ifndef __PERIODIC_TASK_H_
+#define __PERIODIC_TASK_H_
+
+#include <chrono>
+#include <thread>
+
+#include "lock.h"
+#include "cond_var.h"
+
+/*
+ * Background thread running a task every `period`
+ * The task returns true to run again right away ( more work left )
+ * stop() wakes the thread and joins it
+ * */
+class PeriodicTask {
+    LockObject stop_lock;
+    CondVar stop_cond;
+    bool stopped = false;
+    std::thread thread;
+
+    public:
+    PeriodicTask() = default;
+    PeriodicTask(const PeriodicTask &) = delete;
+
+    template<class Tf>
+    void start(std::chrono::milliseconds period, Tf task) {
+        stop();
+        stopped = false;
+        thread = std::thread([this, period, task]() mutable {
+            while (true) {
+                while (task()) {}
+
+                auto l = stop_lock.lock();
+                if (stopped) {
+                    return;
+                }
+                stop_cond.wait_for(stop_lock, period);
+                if (stopped) {
+                    return;
+                }
+            }
+        });
+    }
+
+    bool running() {
+        return thread.joinable();
+    }
+
+    void stop() {
+        if (!thread.joinable()) {
+            return;
+        }
+        { // scope for lock
+            auto l = stop_lock.lock();
+            stopped = true;
+            stop_cond.notify_all();
+        }
+        thread.join();
+    }
+
+    ~PeriodicTask() {
+        stop();
+    }
+};
+
+#endif /* __PERIODIC_TASK_H_ */
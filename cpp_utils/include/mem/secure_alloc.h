@@ -46,6 +46,13 @@ class SecureAllocator {
         size = a.size;
     }
 
+    SecureAllocator(SecureAllocator &&a) {
+        ptr = a.ptr;
+        a.ptr = MAP_FAILED;
+
+        size = a.size;
+    }
+
     SecureAllocator &operator=(SecureAllocator &&a) {
         clear();
         ptr = a.ptr;
@@ -60,6 +67,23 @@ class SecureAllocator {
         return ptr;
     }
 
+    size_t reserved_bytes() {
+        return size;
+    }
+
+    size_t committed_bytes() {
+        return size;
+    }
+
+    // wipes the pages fully inside [offset, offset + len), they stay locked
+    void release(size_t offset, size_t len, bool = false) {
+        auto begin = align_size(offset);
+        auto end = (offset + len) & ((size_t)~(PAGE_SIZE - 1));
+        if (begin < end) {
+            swipe_data(((char*)ptr) + begin, end - begin);
+        }
+    }
+
     template<bool can_move = false>
     void resize(size_t new_size) {
         new_size = align_size(new_size);
@@ -3,46 +3,162 @@
 
 #include <utils/utils.h>
 
+#include <algorithm>
 #include <exception>
 #include <sys/mman.h>
 
 
-class SimpleAllocator {
-    constexpr static int PAGE_SIZE = 4096;
+/*
+ * Page modes of SimpleAllocatorT
+ * PagesTHP      - 2MB aligned mapping with MADV_HUGEPAGE
+ * PagesHugeTLB  - MAP_HUGETLB, huge pages for the whole reservation are
+ *                 taken at construction, falls back to PagesTHP when
+ *                 the system has not enough of them reserved
+ * */
+enum class PageMode {
+    NORMAL, THP, HUGETLB
+};
+
+inline const char *page_mode_str(PageMode m) {
+    switch (m) {
+        case PageMode::THP: return "thp";
+        case PageMode::HUGETLB: return "hugetlb";
+        default: return "normal";
+    }
+}
+
+struct PagesNormal {
+    constexpr static PageMode mode = PageMode::NORMAL;
+};
+
+struct PagesTHP {
+    constexpr static PageMode mode = PageMode::THP;
+};
+
+struct PagesHugeTLB {
+    constexpr static PageMode mode = PageMode::HUGETLB;
+};
+
+/*
+ * Anonymous mapping, `size` bytes are accessible
+ * `reserve` bytes of address space are taken up front as PROT_NONE,
+ * resize() within the reservation never moves the data
+ * Sizes are rounded to the page of the mode that took effect
+ * */
+template<class PagePolicy = PagesNormal>
+class SimpleAllocatorT {
+    constexpr static size_t SMALL_PAGE_SIZE = 4096;
+    constexpr static size_t HUGE_PAGE_SIZE = 2 << 20;
 
     void *ptr = MAP_FAILED;
+    size_t page = SMALL_PAGE_SIZE;
     size_t size;
+    size_t reserved;
+    PageMode mode = PagePolicy::mode;
 
-    static auto align_size(size_t size) {
-        return (size + PAGE_SIZE - 1) & ((size_t)~(PAGE_SIZE - 1));
+    INLINE_WRAPPER
+    size_t align_size(size_t size) {
+        return (size + page - 1) & ~(page - 1);
     }
 
-    public:
+    INLINE_WRAPPER
+    byte *at(size_t offset) {
+        return ((byte*)ptr) + offset;
+    }
 
-    SimpleAllocator(size_t size=size_t(1e9+9))
-        : size(align_size(size)) {
-        ptr = mmap(
-            NULL, size, PROT_READ | PROT_WRITE,
-            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0
+    // maps `len` bytes aligned to `page`, trims the excess
+    void *map_aligned(size_t len, int prot, int flags) {
+        if (page == SMALL_PAGE_SIZE) {
+            return mmap(NULL, len, prot, flags, -1, 0);
+        }
+        auto *p = (byte*)mmap(NULL, len + page, prot, flags, -1, 0);
+        if (p == MAP_FAILED) {
+            return MAP_FAILED;
+        }
+        auto *aligned = (byte*)(((size_t)p + page - 1) & ~(page - 1));
+        if (aligned > p) {
+            munmap(p, aligned - p);
+        }
+        munmap(aligned + len, (p + len + page) - (aligned + len));
+        return aligned;
+    }
+
+    void map(size_t want_size, size_t want_reserve) {
+        if (mode == PageMode::HUGETLB) {
+            page = HUGE_PAGE_SIZE;
+            size = align_size(want_size);
+            reserved = std::max(size, align_size(want_reserve));
+            // no MAP_NORESERVE, missing huge pages fail here, not on fault
+            ptr = mmap(
+                NULL, reserved, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0
+            );
+            if (ptr != MAP_FAILED) {
+                return;
+            }
+            mode = PageMode::THP;
+        }
+
+        page = mode == PageMode::THP ? HUGE_PAGE_SIZE : SMALL_PAGE_SIZE;
+        size = align_size(want_size);
+        reserved = std::max(size, align_size(want_reserve));
+        ptr = map_aligned(
+            reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE
         );
         ASSERT_EXC_VOID(ptr != MAP_FAILED, std::bad_alloc
             //"mmap of", size, "bytes failed"
         );
+        advise_huge(0, reserved);
+    }
+
+    void advise_huge(size_t offset, size_t len) {
+#ifdef MADV_HUGEPAGE
+        if (mode == PageMode::THP) {
+            madvise(at(offset), len, MADV_HUGEPAGE);
+        }
+#endif /* MADV_HUGEPAGE */
+    }
+
+    public:
+
+    SimpleAllocatorT(size_t size=size_t(1e9+9), size_t reserve=0) {
+        map(size, reserve);
+        if (this->size) {
+            ASSERT_EXC_VOID(
+                !mprotect(ptr, this->size, PROT_READ | PROT_WRITE),
+                std::bad_alloc
+            );
+        }
+    }
+
+    // mode that took effect
+    PageMode page_mode() {
+        return mode;
     }
 
-    SimpleAllocator(SimpleAllocator &&a) {
+    size_t page_size() {
+        return page;
+    }
+
+    SimpleAllocatorT(SimpleAllocatorT &&a) {
         ptr = a.ptr;
         a.ptr = MAP_FAILED;
 
+        page = a.page;
         size = a.size;
+        reserved = a.reserved;
+        mode = a.mode;
     }
 
-    SimpleAllocator &operator=(SimpleAllocator &&a) {
+    SimpleAllocatorT &operator=(SimpleAllocatorT &&a) {
         clear();
         ptr = a.ptr;
         a.ptr = MAP_FAILED;
 
+        page = a.page;
         size = a.size;
+        reserved = a.reserved;
+        mode = a.mode;
 
         return *this;
     }
@@ -51,34 +167,104 @@ class SimpleAllocator {
         return ptr;
     }
 
+    // address space taken
+    size_t reserved_bytes() {
+        return reserved;
+    }
+
+    // accessible part
+    size_t committed_bytes() {
+        return size;
+    }
+
+    /*
+     * Returns the pages fully inside [offset, offset + len) to the kernel
+     * Mapping stays, the pages read back as zeros ( or old data with
+     * lazy MADV_FREE, which frees them only under memory pressure )
+     * */
+    void release(size_t offset, size_t len, bool lazy = false) {
+        auto begin = align_size(offset);
+        auto end = (offset + len) & ~(page - 1);
+        if (begin >= end) {
+            return;
+        }
+#ifdef MADV_FREE
+        if (lazy && !madvise(at(begin), end - begin, MADV_FREE)) {
+            return;
+        }
+#endif /* MADV_FREE */
+        madvise(at(begin), end - begin, MADV_DONTNEED);
+    }
+
+    /*
+     * Makes [offset, offset + len) of the reservation accessible,
+     * committed_bytes() is not changed, for users carving the
+     * reservation into parts that grow independently
+     * */
+    void commit(size_t offset, size_t len) {
+        auto begin = offset & ~(page - 1);
+        auto end = align_size(offset + len);
+        ASSERT_EXC_VOID(end <= reserved, std::bad_alloc);
+        ASSERT_EXC_VOID(!mprotect(
+            at(begin), end - begin, PROT_READ | PROT_WRITE
+        ), std::bad_alloc);
+    }
+
     template<bool can_move = false>
     void resize(size_t new_size) {
         new_size = align_size(new_size);
-        if (likely(size != new_size)) {
-            auto new_ptr = mremap(
-                ptr, size, new_size, can_move ? MREMAP_MAYMOVE : 0
-            );
-
-            ASSERT_EXC_VOID(new_ptr != MAP_FAILED, std::bad_alloc
-                //"mremap of", size, "to", new_size, "failed"
-            );
-
-            ptr = new_ptr;
+        if (unlikely(size == new_size)) {
+            return;
+        }
+        if (new_size <= reserved) {
+            if (new_size > size) {
+                ASSERT_EXC_VOID(!mprotect(
+                    at(size), new_size - size, PROT_READ | PROT_WRITE
+                ), std::bad_alloc);
+            } else {
+                madvise(at(new_size), size - new_size, MADV_DONTNEED);
+                mprotect(at(new_size), size - new_size, PROT_NONE);
+            }
             size = new_size;
+            return;
         }
+
+        // mremap needs a single mapping
+        if (reserved > size) {
+            ASSERT_EXC_VOID(!mprotect(
+                at(size), reserved - size, PROT_READ | PROT_WRITE
+            ), std::bad_alloc);
+        }
+        auto new_ptr = mremap(
+            ptr, reserved, new_size, can_move ? MREMAP_MAYMOVE : 0
+        );
+        if (unlikely(new_ptr == MAP_FAILED)) {
+            if (reserved > size) {
+                mprotect(at(size), reserved - size, PROT_NONE);
+            }
+            throw std::bad_alloc();
+            //"mremap of", size, "to", new_size, "failed"
+        }
+
+        ptr = new_ptr;
+        size = new_size;
+        reserved = new_size;
+        advise_huge(0, reserved);
     }
 
     void clear() {
         if (likely(ptr != MAP_FAILED)) {
-            munmap(ptr, size);
+            munmap(ptr, reserved);
             ptr = MAP_FAILED;
         }
     }
 
-    ~SimpleAllocator() {
+    ~SimpleAllocatorT() {
         clear();
     }
 };
 
+using SimpleAllocator = SimpleAllocatorT<>;
+
 #endif /* __SIMPLE_ALLOC_H_ */
 
@@ -0,0 +1,329 @@
+#ifndef __SLAB_ALLOC_H_
+#define __SLAB_ALLOC_H_
+
+#include <memory_resource>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+
+#include "free_index.h"
+#include "simple_alloc.h"
+#include "thread_records.h"
+
+/* Largest slab size class, bigger requests go to malloc */
+#define SLAB_MAX_SIZE (32u << 10)
+/* Address space reserved per size class */
+#define SLAB_CLASS_RESERVE (size_t(1) << 30)
+
+/* std::pmr adapter of a SlabAlloc */
+template<class Tslab>
+class SlabResource : public std::pmr::memory_resource {
+    Tslab &slab;
+
+    void *do_allocate(size_t bytes, size_t align) override {
+        return slab.alloc(bytes, align);
+    }
+
+    void do_deallocate(void *p, size_t, size_t) override {
+        slab.free(p);
+    }
+
+    bool do_is_equal(
+        const std::pmr::memory_resource &other
+    ) const noexcept override {
+        return this == &other;
+    }
+
+    public:
+    SlabResource(Tslab &slab) : slab(slab) {}
+};
+
+/*
+ * Size class allocator for variable sized objects
+ * Classes go by powers of two and a half: 16, 24, 32, 48 ... SLAB_MAX_SIZE
+ * Each class is a BlockAlloc-like array of slots in its own
+ * SLAB_CLASS_RESERVE part of one SimpleAllocator reservation, committed
+ * as it grows, so free() finds the class and slot from the address alone
+ * Free slots sit in a FreeIndexStack per class behind per thread
+ * magazines of MAG_SIZE slots, freeing on another thread is fine
+ * Blocks are aligned as any object of the requested size needs,
+ * stronger alignment picks a bigger class
+ * */
+template<int MAG_SIZE = 64>
+class SlabAlloc {
+    static_assert(MAG_SIZE >= 2, "Magazine too small");
+
+    public:
+        using idx_t = uint32_t;
+
+        constexpr static size_t MIN_SIZE = 16;
+
+        // class of blocks of `n` bytes
+        INLINE_WRAPPER
+        constexpr static int size_class(size_t n) {
+            if (n <= MIN_SIZE) {
+                return 0;
+            }
+            auto m = n - 1;
+            int k = 63 - __builtin_clzll(m);
+            // (2^k, 1.5 * 2^k] or (1.5 * 2^k, 2^(k+1)]
+            return 2 * (k - 4) + 1 + (int)((m >> (k - 1)) & 1);
+        }
+
+        INLINE_WRAPPER
+        constexpr static size_t class_size(int c) {
+            return (size_t)(c & 1 ? 3 : 2) << (c / 2 + 3);
+        }
+
+        constexpr static int NUM_CLASSES = size_class(SLAB_MAX_SIZE) + 1;
+
+    private:
+    static_assert(
+        class_size(NUM_CLASSES - 1) == SLAB_MAX_SIZE,
+        "SLAB_MAX_SIZE MUST be a size class"
+    );
+
+    constexpr static int BATCH = MAG_SIZE / 2;
+    constexpr static size_t PAGE = 4096;
+    constexpr static size_t COMMIT_MIN = 64 << 10;
+
+    struct SizeClass {
+        size_t obj_size;
+        size_t committed = 0;
+        idx_t size = 0;
+        idx_t capacity = 0;
+        idx_t max_capacity;
+        LockObject grow_lock;
+        FreeIndexStack<idx_t> free_index;
+    };
+
+    struct Magazine {
+        int n = 0;
+        idx_t idx[MAG_SIZE];
+    };
+
+    struct Front {
+        SlabAlloc *owner;
+        Magazine mags[NUM_CLASSES];
+    };
+
+    using Records = ThreadRecords<SlabAlloc, Front>;
+    friend Records;
+
+    SimpleAllocator buffer;
+    SizeClass classes[NUM_CLASSES];
+
+    LockObject reg_lock;
+    std::vector<Front*> fronts;
+
+    SlabResource<SlabAlloc> res{*this};
+
+    // slot array access for the free index
+    struct Slots {
+        SlabAlloc &a;
+        int c;
+
+        INLINE_WRAPPER
+        idx_t &link(idx_t i) {
+            return *(idx_t*)a.at(c, i);
+        }
+
+        // throws std::bad_alloc when the class reservation is full
+        idx_t grow(idx_t n) {
+            auto &sc = a.classes[c];
+            auto s = __atomic_load_n(&sc.size, __ATOMIC_RELAXED);
+            do {
+                if (unlikely((size_t)s + n > sc.max_capacity)) {
+                    throw std::bad_alloc();
+                }
+            } while (!__atomic_compare_exchange_n(
+                &sc.size, &s, s + n, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED
+            ));
+            if (unlikely(
+                s + n > __atomic_load_n(&sc.capacity, __ATOMIC_ACQUIRE)
+            )) {
+                a.grow_capacity(c, s + n);
+            }
+            return s;
+        }
+    };
+
+    INLINE_WRAPPER
+    byte *base() {
+        return (byte*)buffer.get_data();
+    }
+
+    INLINE_WRAPPER
+    void *at(int c, idx_t i) {
+        return base() + c * SLAB_CLASS_RESERVE + i * class_size(c);
+    }
+
+    INLINE_WRAPPER
+    constexpr static size_t class_align(int c) {
+        return std::min(class_size(c) & -class_size(c), PAGE);
+    }
+
+    // commits the slots of class `c` below `need`
+    RARE_FUNC
+    void grow_capacity(int c, idx_t need) {
+        auto &sc = classes[c];
+        auto l = sc.grow_lock.lock();
+        if (need <= sc.capacity) {
+            return;
+        }
+        auto bytes = std::max({
+            (size_t)need * sc.obj_size, sc.committed * 2, COMMIT_MIN
+        });
+        bytes = std::min((bytes + PAGE - 1) & ~(PAGE - 1), SLAB_CLASS_RESERVE);
+        buffer.commit(c * SLAB_CLASS_RESERVE + sc.committed, bytes - sc.committed);
+        sc.committed = bytes;
+        __atomic_store_n(
+            &sc.capacity, (idx_t)(bytes / sc.obj_size), __ATOMIC_RELEASE
+        );
+    }
+
+    // thread exit, the slots go back to the shared stacks
+    void release(Front *f) {
+        auto l = reg_lock.lock();
+        for (int c = 0; c < NUM_CLASSES; c++) {
+            Slots slots{*this, c};
+            classes[c].free_index.push_many(f->mags[c].idx, f->mags[c].n, slots);
+        }
+        fronts.erase(std::find(fronts.begin(), fronts.end(), f));
+    }
+
+    void attach(Front *f) {
+        auto l = reg_lock.lock();
+        fronts.push_back(f);
+    }
+
+    INLINE_WRAPPER
+    Front &front() {
+        return Records::get(this);
+    }
+
+    RARE_FUNC
+    void refill(int c, Magazine &m) {
+        Slots slots{*this, c};
+        m.n = classes[c].free_index.pop_many(m.idx, BATCH, slots);
+        if (m.n) {
+            return;
+        }
+        auto first = slots.grow(BATCH);
+        // hand out the lowest one first
+        for (int k = BATCH - 1; k >= 0; k--) {
+            m.idx[m.n++] = first + k;
+        }
+    }
+
+    RARE_FUNC
+    void flush(int c, Magazine &m) {
+        Slots slots{*this, c};
+        m.n -= BATCH;
+        classes[c].free_index.push_many(m.idx + m.n, BATCH, slots);
+    }
+
+    RARE_FUNC
+    static void *alloc_large(size_t n, size_t align) {
+        void *p = align <= alignof(std::max_align_t)
+            ? malloc(n)
+            : aligned_alloc(align, (n + align - 1) & ~(align - 1));
+        ASSERT_EXC_VOID(p, std::bad_alloc);
+        return p;
+    }
+
+    public:
+
+    SlabAlloc()
+        : buffer(0, NUM_CLASSES * SLAB_CLASS_RESERVE) {
+        for (int c = 0; c < NUM_CLASSES; c++) {
+            classes[c].obj_size = class_size(c);
+            classes[c].max_capacity = (idx_t)std::min<size_t>(
+                SLAB_CLASS_RESERVE / class_size(c), UINT32_MAX
+            );
+        }
+    }
+
+    SlabAlloc(const SlabAlloc &) = delete;
+
+    ~SlabAlloc() {
+        auto ld = Records::detach_lock().lock();
+        auto l = reg_lock.lock();
+        for (auto *f : fronts) {
+            f->owner = NULL;
+        }
+    }
+
+    /*
+     * At least `n` bytes aligned to `align`, the default alignment
+     * fits any object of `n` bytes
+     * */
+    INLINE_WRAPPER
+    void *alloc(size_t n, size_t align = 1) {
+        if (unlikely(n > SLAB_MAX_SIZE)) {
+            return alloc_large(n, align);
+        }
+        auto c = size_class(n);
+        if (unlikely(align > class_align(c))) {
+            while (c < NUM_CLASSES && align > class_align(c)) {
+                c++;
+            }
+            if (c == NUM_CLASSES) {
+                return alloc_large(n, align);
+            }
+        }
+        auto &m = front().mags[c];
+        if (unlikely(!m.n)) {
+            refill(c, m);
+        }
+        return at(c, m.idx[--m.n]);
+    }
+
+    // takes blocks of alloc() and of malloc()
+    INLINE_WRAPPER
+    void free(void *p) {
+        auto off = (size_t)((byte*)p - base());
+        if (unlikely(off >= NUM_CLASSES * SLAB_CLASS_RESERVE)) {
+            ::free(p);
+            return;
+        }
+        int c = off / SLAB_CLASS_RESERVE;
+        off %= SLAB_CLASS_RESERVE;
+        // class size is 2^k or 3 * 2^(k-1)
+        auto i = (idx_t)(c & 1
+            ? (off >> (c / 2 + 3)) / 3
+            : off >> (c / 2 + 4)
+        );
+        auto &m = front().mags[c];
+        if (unlikely(m.n == MAG_SIZE)) {
+            flush(c, m);
+        }
+        m.idx[m.n++] = i;
+    }
+
+    std::pmr::memory_resource *resource() {
+        return &res;
+    }
+
+    // bytes committed for the size classes
+    size_t committed_bytes() {
+        size_t bytes = 0;
+        for (auto &sc : classes) {
+            auto l = sc.grow_lock.lock();
+            bytes += sc.committed;
+        }
+        return bytes;
+    }
+
+    size_t reserved_bytes() {
+        return buffer.reserved_bytes();
+    }
+};
+
+/* Process wide slab allocator */
+inline SlabAlloc<> &default_slab() {
+    static SlabAlloc<> slab;
+    return slab;
+}
+
+#endif /* __SLAB_ALLOC_H_ */
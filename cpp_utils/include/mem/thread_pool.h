@@ -0,0 +1,137 @@
+#ifndef __THREAD_POOL_H_
+#define __THREAD_POOL_H_
+
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "lock.h"
+#include "cond_var.h"
+
+/*
+ * Fixed set of worker threads for data parallel loops
+ * parallel_for() hands out chunk numbers, the calling thread takes
+ * part too, so a pool of 0 workers runs everything inline
+ * One parallel_for() at a time, concurrent callers are serialized
+ * */
+class ThreadPool {
+    LockObject run_lock;
+    LockObject lock;
+    CondVar start_cond;
+    CondVar done_cond;
+    std::vector<std::thread> threads;
+
+    const std::function<void(int)> *job = NULL;
+    int num_chunks = 0;
+    int next_chunk = 0;
+    int done_chunks = 0;
+    // threads that may still call job
+    int active = 0;
+    unsigned generation = 0;
+    bool stopped = false;
+
+    // takes chunks until none are left
+    void run_chunks(const std::function<void(int)> &f) {
+        int done = 0;
+        while (true) {
+            auto c = __atomic_fetch_add(&next_chunk, 1, __ATOMIC_RELAXED);
+            if (c >= num_chunks) {
+                break;
+            }
+            f(c);
+            done++;
+        }
+        auto l = lock.lock();
+        done_chunks += done;
+        active--;
+        if (finished()) {
+            done_cond.notify_all();
+        }
+    }
+
+    // lock MUST be held
+    bool finished() {
+        return done_chunks == num_chunks && !active;
+    }
+
+    void worker() {
+        unsigned seen = 0;
+        while (true) {
+            const std::function<void(int)> *f;
+            { // scope for lock
+                auto l = lock.lock();
+                start_cond.wait(lock, [&]() {
+                    return stopped || generation != seen;
+                });
+                if (stopped) {
+                    return;
+                }
+                seen = generation;
+                // woke up after the loop was over
+                if (!job) {
+                    continue;
+                }
+                f = job;
+                active++;
+            }
+            run_chunks(*f);
+        }
+    }
+
+    public:
+    explicit ThreadPool(
+        int n = std::max(1u, std::thread::hardware_concurrency()) - 1
+    ) {
+        for (int i = 0; i < n; i++) {
+            threads.emplace_back([this]() {
+                worker();
+            });
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+
+    ~ThreadPool() {
+        { // scope for lock
+            auto l = lock.lock();
+            stopped = true;
+            start_cond.notify_all();
+        }
+        for (auto &t : threads) {
+            t.join();
+        }
+    }
+
+    // workers plus the calling thread
+    int concurrency() {
+        return threads.size() + 1;
+    }
+
+    // runs f(chunk) for every chunk in [0, n), returns when all are done
+    template<class Tf>
+    void parallel_for(int n, Tf &&f) {
+        if (n <= 0) {
+            return;
+        }
+        std::function<void(int)> fn(std::ref(f));
+        auto lr = run_lock.lock();
+        { // scope for lock
+            auto l = lock.lock();
+            job = &fn;
+            num_chunks = n;
+            done_chunks = 0;
+            active = 1;
+            __atomic_store_n(&next_chunk, 0, __ATOMIC_RELAXED);
+            generation++;
+            start_cond.notify_all();
+        }
+        run_chunks(fn);
+        auto l = lock.lock();
+        done_cond.wait(lock, [&]() {
+            return finished();
+        });
+        job = NULL;
+    }
+};
+
+#endif /* __THREAD_POOL_H_ */
@@ -0,0 +1,88 @@
+#ifndef __THREAD_RECORDS_H_
+#define __THREAD_RECORDS_H_
+
+#include <vector>
+
+#include "lock.h"
+
+/*
+ * Per thread records of Towner instances, kept in a thread_local cache
+ * Trec MUST have a `Towner *owner` member, Towner provides
+ *  attach(Trec*): a new record of the calling thread
+ *  release(Trec*): thread exit, the record is deleted after it
+ * ~Towner() MUST clear owner of its records under detach_lock(),
+ * thread exit reads it under the same lock. Records of destroyed
+ * instances are dropped on the next lookup of a new instance
+ * */
+template<class Towner, class Trec>
+class ThreadRecords {
+    struct Cache {
+        Trec *last = NULL;
+        std::vector<Trec*> records;
+
+        ~Cache() {
+            for (auto *r : records) {
+                { // scope for lock
+                    auto l = detach_lock().lock();
+                    if (r->owner) {
+                        r->owner->release(r);
+                    }
+                }
+                delete r;
+            }
+        }
+    };
+
+    static Cache &cache() {
+        static thread_local Cache c;
+        return c;
+    }
+
+    RARE_FUNC
+    static Trec &lookup(Towner *owner) {
+        auto &c = cache();
+        Trec *found = NULL;
+        { // scope for lock
+            auto l = detach_lock().lock();
+            size_t k = 0;
+            for (auto *r : c.records) {
+                if (!r->owner) {
+                    delete r;
+                    continue;
+                }
+                if (r->owner == owner) {
+                    found = r;
+                }
+                c.records[k++] = r;
+            }
+            c.records.resize(k);
+        }
+        if (!found) {
+            found = new Trec();
+            found->owner = owner;
+            owner->attach(found);
+            c.records.push_back(found);
+        }
+        c.last = found;
+        return *found;
+    }
+
+    public:
+    // outlives every instance, unlike their own locks
+    static LockObject &detach_lock() {
+        static auto *l = new LockObject();
+        return *l;
+    }
+
+    // record of the calling thread
+    INLINE_WRAPPER
+    static Trec &get(Towner *owner) {
+        auto *r = cache().last;
+        if (likely(r && r->owner == owner)) {
+            return *r;
+        }
+        return lookup(owner);
+    }
+};
+
+#endif /* __THREAD_RECORDS_H_ */
@@ -8,6 +8,7 @@
 #include <unordered_set>
 #include <vector>
 
+#include <mem/cond_var.h>
 #include <mem/lock.h>
 
 constexpr auto CHANNEL_LOG_LEVEL_files = LogLevel::DEBUG;
@@ -20,9 +21,11 @@ class CompileDependencyTracker : public LockObject {
   std::unordered_set<int> to_compile;
   std::unordered_set<int> failed_obj;
 
+  CondVar to_compile_cond;
+
   void add_to_compile(int v) {
     to_compile.insert(v);
-    notify();
+    to_compile_cond.notify_one();
   }
 
   void inc_obj_dep(int v, bool from_source = true) {
@@ -89,7 +92,7 @@ public:
     auto b = to_compile.begin();
 
     while (b == to_compile.end() && (!run || *run)) {
-      wait();
+      to_compile_cond.wait(*this);
       b = to_compile.begin();
     }
 
@@ -102,6 +105,13 @@ public:
     return r;
   }
 
+  // wakes all compile_pop() callers, e.g. to check stop condition
+  void wake_all() {
+    auto l = lock();
+
+    to_compile_cond.notify_all();
+  }
+
   void compile_fail(int v) {
     auto l = lock();
 
@@ -133,7 +133,7 @@ public:
     auto l = lock();
 
     run = false;
-    dependency_tracker.notifyAll();
+    dependency_tracker.wake_all();
     for (auto &t : compile_workers) {
       t.join();
     }
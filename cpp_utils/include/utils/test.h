@@ -6,6 +6,7 @@
 #include <sys/times.h>
 #include <unistd.h>
 #include <algorithm>
+#include <vector>
 
 #include "utils.h"
 
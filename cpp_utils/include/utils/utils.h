@@ -285,4 +285,11 @@ void for_one(Tlambda &&p, std::tuple<Targs...> t, int n) {
 class EmptyObject {};
 static constexpr EmptyObject empty;
 
+#define CACHE_LINE_SIZE 64
+
+/* Keeps `v` alone on its cache line(s) */
+template <class T> struct alignas(CACHE_LINE_SIZE) CachePadded {
+  T v;
+};
+
 #endif /* __UTILS_H_ */
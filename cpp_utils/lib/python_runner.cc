@@ -1,12 +1,15 @@
 #include <boost/core/noncopyable.hpp>
 #include <boost/python.hpp>
 
+#include <mem/lock_stats.h>
 #include <runner/manager.h>
 #include <runner/targets.h>
 
 using namespace boost::python;
 
 BOOST_PYTHON_MODULE(python_runner) {
+  def("lock_stats_dump", &lock_stats_dump, (arg("n") = 16));
+
   class_<FromSourceTarget>("FromSourceTarget")
       .def_readwrite("target", &FromSourceTarget::target)
       .def_readwrite("source", &FromSourceTarget::source)
@@ -0,0 +1,97 @@
+#include "mem/arena_alloc.h"
+
+#include "utils/test.h"
+
+#include <memory_resource>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+void test_arena_alloc() {
+    ArenaAlloc<> a(64 << 20, 1 << 20);
+    auto *p = a.allocate(3, 1);
+    auto *q = a.allocate_n<uint64_t>(4);
+    ASSERT((size_t)q % alignof(uint64_t) == 0, "Misaligned allocation");
+    ASSERT((char*)q > (char*)p, "Bump pointer went back");
+
+    // past the first commit step
+    auto *big = (char*)a.allocate(8 << 20);
+    std::fill(big, big + (8 << 20), 1);
+    auto committed = a.committed_bytes();
+    ASSERT(committed >= (8 << 20), "Pages were not committed", committed);
+
+    a.reset();
+    auto used = a.used_bytes();
+    ASSERT(used == 0, "Reset kept allocations", used);
+    auto *again = a.allocate(3, 1);
+    ASSERT(again == p, "Reset did not rewind");
+
+    a.reset(1 << 20);
+    ASSERT(big[(4 << 20)] == 0, "Released page kept its data");
+
+    bool failed = false;
+    try {
+        a.allocate(128 << 20);
+    } catch (std::bad_alloc &) {
+        failed = true;
+    }
+    ASSERT(failed, "Allocation past the reservation succeeded");
+}
+
+void test_pmr_containers() {
+    PmrArena<> a(64 << 20);
+    auto *res = a.resource();
+    {
+        std::pmr::vector<int> v(res);
+        std::pmr::unordered_map<int, int> m(res);
+        std::pmr::set<int> s(res);
+        for (int i = 0; i < 10000; i++) {
+            v.push_back(i);
+            m[i] = i * 2;
+            s.insert(-i);
+        }
+        auto vs = v.size();
+        ASSERT(vs == 10000, "Wrong vector size", vs);
+        auto m7 = m[7];
+        ASSERT(m7 == 14, "Wrong map value", m7);
+        auto first = *s.begin();
+        ASSERT(first == -9999, "Wrong set order", first);
+    }
+    auto used = a.used_bytes();
+    ASSERT(used > 0, "Containers did not use the arena");
+    a.reset();
+
+    auto &t = thread_arena();
+    std::pmr::vector<int> tv(t.resource());
+    tv.resize(100);
+    ASSERT(t.used_bytes() >= 100 * sizeof(int), "Thread arena not used");
+}
+
+// builds a short lived map per iteration
+template<bool with_arena>
+void test_many_maps(int nit, int n) {
+    auto &a = thread_arena();
+    std::pmr::memory_resource *res = with_arena
+        ? a.resource() : std::pmr::new_delete_resource();
+    for (int it = 0; it < nit; it++) {
+        { // scope for map
+            std::pmr::unordered_map<int, int> m(res);
+            for (int i = 0; i < n; i++) {
+                m[i] = i;
+            }
+        }
+        if (with_arena) {
+            a.reset();
+        }
+    }
+}
+
+int test() {
+    TEST(test_arena_alloc).run();
+    TEST(test_pmr_containers).run();
+    TEST(test_many_maps<false>).benchmark(10, 1000, 1000);
+    TEST(test_many_maps<true>).benchmark(10, 1000, 1000);
+    return 0;
+}
@@ -1,8 +1,15 @@
 #include "mem/block_alloc.h"
+#include "mem/block_alloc_move.h"
+#include "mem/block_alloc_soa.h"
+#include "mem/block_alloc_tree.h"
 #include "mem/secure_alloc.h"
 
 #include "utils/test.h"
 
+#include <memory>
+#include <numeric>
+#include <random>
+#include <set>
 #include <thread>
 
 using namespace std;
@@ -23,7 +30,9 @@ BlockAlloc<TestObj> TestObj::allocator;
 
 class TestObjSecure {
     public:
-        static BlockAlloc<TestObjSecure, SecureAllocator<>> allocator;
+        static BlockAlloc<
+            TestObjSecure, SecureAllocator<>, LockObject, FreeIndexSet
+        > allocator;
 
         int v = 0;
         int inc() {
@@ -33,7 +42,265 @@ class TestObjSecure {
             return --v;
         }
 };
-BlockAlloc<TestObjSecure, SecureAllocator<>> TestObjSecure::allocator;
+BlockAlloc<
+    TestObjSecure, SecureAllocator<>, LockObject, FreeIndexSet
+> TestObjSecure::allocator;
+
+class TestObjSecureTree {
+    public:
+        static BlockAlloc<
+            TestObjSecureTree, SecureAllocator<>, LockObject, FreeIndexTree
+        > allocator;
+
+        int v = 0;
+};
+BlockAlloc<
+    TestObjSecureTree, SecureAllocator<>, LockObject, FreeIndexTree
+> TestObjSecureTree::allocator;
+
+class TestObjShared {
+    public:
+        static BlockAlloc<
+            TestObjShared, SimpleAllocator, SharedLockObject
+        > allocator;
+
+        int v = 0;
+        int inc() {
+            return ++v;
+        }
+        int get() const {
+            return v;
+        }
+};
+BlockAlloc<
+    TestObjShared, SimpleAllocator, SharedLockObject
+> TestObjShared::allocator;
+
+class TestObjDense {
+    public:
+        static BlockAlloc<
+            TestObjDense, SimpleAllocator, LockObject, FreeIndexSet
+        > allocator;
+
+        int v = 0;
+        int inc() {
+            return ++v;
+        }
+};
+BlockAlloc<
+    TestObjDense, SimpleAllocator, LockObject, FreeIndexSet
+> TestObjDense::allocator;
+
+class TestObjMag {
+    public:
+        static BlockAlloc<
+            TestObjMag, SimpleAllocator, LockObject, FreeIndexMagazine
+        > allocator;
+
+        int v = 0;
+        int inc() {
+            return ++v;
+        }
+};
+BlockAlloc<
+    TestObjMag, SimpleAllocator, LockObject, FreeIndexMagazine
+> TestObjMag::allocator;
+
+class TestObjTree {
+    public:
+        static BlockAlloc<
+            TestObjTree, SimpleAllocator, LockObject, FreeIndexTree
+        > allocator;
+
+        int v = 0;
+        int inc() {
+            return ++v;
+        }
+};
+BlockAlloc<
+    TestObjTree, SimpleAllocator, LockObject, FreeIndexTree
+> TestObjTree::allocator;
+
+class TestObjMove {
+    public:
+        static BlockAllocMove<TestObjMove> allocator;
+
+        int v = 0;
+        int inc() {
+            return ++v;
+        }
+};
+BlockAllocMove<TestObjMove> TestObjMove::allocator;
+
+class TestObjMoveCap {
+    public:
+        static BlockAllocMove<TestObjMoveCap> allocator;
+
+        int v = 0;
+};
+BlockAllocMove<TestObjMoveCap> TestObjMoveCap::allocator(16, 1 << 10);
+
+class TestObjMoveBig {
+    public:
+        static BlockAllocMove<TestObjMoveBig> allocator;
+
+        int v = 0;
+        char pad[508];
+};
+BlockAllocMove<TestObjMoveBig> TestObjMoveBig::allocator;
+
+class TestObjRef {
+    public:
+        static BlockAlloc<TestObjRef> allocator;
+        static int num_alive;
+
+        int v = 0;
+        TestObjRef() {
+            __sync_add_and_fetch(&num_alive, 1);
+        }
+        ~TestObjRef() {
+            __sync_add_and_fetch(&num_alive, -1);
+        }
+        int inc() {
+            return ++v;
+        }
+};
+template<>
+struct block_alloc_shared_ref<TestObjRef> : std::true_type {};
+BlockAlloc<TestObjRef> TestObjRef::allocator;
+int TestObjRef::num_alive = 0;
+
+class TestObjCap {
+    public:
+        static BlockAlloc<TestObjCap> allocator;
+
+        long v = 0;
+};
+BlockAlloc<TestObjCap> TestObjCap::allocator(16, 1 << 16);
+
+class TestObjBig {
+    public:
+        static BlockAlloc<
+            TestObjBig, SimpleAllocator, LockObject, FreeIndexSet
+        > allocator;
+
+        char data[256];
+        TestObjBig() {
+            memset(data, 1, sizeof(data));
+        }
+};
+BlockAlloc<
+    TestObjBig, SimpleAllocator, LockObject, FreeIndexSet
+> TestObjBig::allocator;
+
+class TestObjSeq {
+    public:
+        static BlockAlloc<TestObjSeq> allocator;
+
+        // invariant: a + b == 0
+        long a = 0;
+        long b = 0;
+        void inc() {
+            a++;
+            b--;
+        }
+};
+template<>
+struct block_alloc_optimistic_read<TestObjSeq> : std::true_type {};
+BlockAlloc<TestObjSeq> TestObjSeq::allocator;
+
+class TestObjIter {
+    public:
+        static BlockAlloc<TestObjIter> allocator;
+
+        long v = 0;
+};
+template<>
+struct block_alloc_iterable<TestObjIter> : std::true_type {};
+BlockAlloc<TestObjIter> TestObjIter::allocator;
+
+class TestObjEpoch {
+    public:
+        static BlockAlloc<TestObjEpoch> allocator;
+        constexpr static long MAGIC = 0x5eed;
+
+        long v = MAGIC;
+        ~TestObjEpoch() {
+            v = 0;
+        }
+};
+BlockAlloc<TestObjEpoch> TestObjEpoch::allocator;
+
+class TestObjGen {
+    public:
+        static BlockAlloc<TestObjGen> allocator;
+
+        int v = 0;
+        int inc() {
+            return ++v;
+        }
+};
+template<>
+struct block_alloc_generation<TestObjGen> : std::true_type {};
+BlockAlloc<TestObjGen> TestObjGen::allocator;
+
+class TestObjSmall {
+    public:
+        static BlockAlloc<TestObjSmall> allocator;
+
+        int v = 0;
+        int inc() {
+            return ++v;
+        }
+};
+template<>
+struct block_alloc_capacity<TestObjSmall>
+    : std::integral_constant<uint64_t, 1000> {};
+BlockAlloc<TestObjSmall> TestObjSmall::allocator;
+
+class TestObjHuge {
+    public:
+        static BlockAlloc<TestObjHuge> allocator;
+
+        long v = 0;
+};
+template<>
+struct block_alloc_capacity<TestObjHuge>
+    : std::integral_constant<uint64_t, (1ull << 33)> {};
+BlockAlloc<TestObjHuge> TestObjHuge::allocator;
+
+class TestSoa {
+    public:
+        struct Price : SoaField<double> {};
+        struct Qty : SoaField<int> {};
+        struct Id : SoaField<long> {};
+
+        static BlockAllocSoA<TestSoa, SoaFields<Price, Qty, Id>> allocator;
+};
+BlockAllocSoA<TestSoa, SoaFields<TestSoa::Price, TestSoa::Qty, TestSoa::Id>>
+    TestSoa::allocator;
+
+class TestSoaSecure {
+    public:
+        struct Qty : SoaField<int> {};
+        struct Id : SoaField<long> {};
+
+        static BlockAllocSoA<
+            TestSoaSecure, SoaFields<Qty, Id>, SecureAllocator<>
+        > allocator;
+};
+BlockAllocSoA<
+    TestSoaSecure, SoaFields<TestSoaSecure::Qty, TestSoaSecure::Id>,
+    SecureAllocator<>
+> TestSoaSecure::allocator;
+
+// same fields plus cold payload, array of structs
+struct TestAos {
+    double price;
+    int qty;
+    long id;
+    char payload[40];
+};
 
 void test_alloc() {
     auto ref = TestObj::allocator.emplace();
@@ -47,18 +314,171 @@ void test_alloc_secure() {
     u.obj().inc();
 }
 
+template<class Tobj>
+void test_reposition() {
+    std::unique_ptr<SingleOwnerRefHolder<Tobj>> a(
+        new SingleOwnerRefHolder<Tobj>(Tobj::allocator.emplace())
+    );
+    auto b = Tobj::allocator.emplace();
+    auto c = Tobj::allocator.emplace();
+    {
+        auto u = c.use();
+        u.obj().inc();
+    }
+    auto ia = a->index();
+    a.reset();
+    c.reposition();
+    auto ic = c.index();
+    ASSERT(ic == ia, "Object not moved to the free slot", ic, ia);
+    auto u = c.use();
+    auto v = u.obj().v;
+    ASSERT(v == 1, "Object value lost on reposition", v);
+}
+
+// BitTree against std::set of used positions
+void test_bit_tree(int n, int nit) {
+    BitTree t(n);
+    std::set<size_t> used;
+    std::mt19937 rng(42);
+    for (int i = 0; i < nit; i++) {
+        size_t pos = rng() % n;
+        if (t.test(pos)) {
+            t.unset(pos);
+            used.erase(pos);
+        } else {
+            t.set(pos);
+            used.insert(pos);
+        }
+        size_t ff = 0;
+        while (used.count(ff)) {
+            ff++;
+        }
+        auto tff = t.first_free();
+        ASSERT(tff == ff, "Invalid first_free", tff, ff);
+        ssize_t lu = used.empty() ? -1 : *used.rbegin();
+        auto tlu = t.last_used();
+        ASSERT(tlu == lu, "Invalid last_used", tlu, lu);
+    }
+}
+
+// lowest free slot in an almost full multi-million slot tree
+void test_bit_tree_first_free(int n, int nit) {
+    BitTree t(n);
+    for (int i = 0; i < n; i++) {
+        t.set(i);
+    }
+    size_t s = 0;
+    for (int i = 0; i < nit; i++) {
+        size_t pos = (i * 7919ul) % n;
+        t.unset(pos);
+        s += t.first_free();
+        t.set(pos);
+    }
+    ASSERT(s, "Invalid sum");
+}
+
+// links of popped slots get overwritten, as user data would
+struct StackSlots {
+    std::vector<uint32_t> links;
+    std::vector<int> owner;
+
+    uint32_t &link(uint32_t i) {
+        auto n = links.size();
+        ASSERT(i < n, "Link out of bounds", i, n);
+        return links[i];
+    }
+};
+
+void stack_thread(FreeIndexStack<uint32_t> *st, StackSlots *slots,
+        int tid, int nit) {
+    constexpr int N = 16;
+    uint32_t ids[N];
+    for (int i = 0; i < nit; i++) {
+        int n = i % 4 ? st->pop_many(ids, N, *slots) : st->pop(ids[0], *slots);
+        for (int k = 0; k < n; k++) {
+            auto prev = __atomic_exchange_n(
+                &slots->owner[ids[k]], tid, __ATOMIC_RELAXED
+            );
+            ASSERT(prev == -1, "Slot popped twice", ids[k], prev);
+            __atomic_store_n(&slots->links[ids[k]], 0xdead0000, __ATOMIC_RELAXED);
+        }
+        for (int k = 0; k < n; k++) {
+            __atomic_store_n(&slots->owner[ids[k]], -1, __ATOMIC_RELAXED);
+        }
+        st->push_many(ids, n, *slots);
+    }
+}
+
+void test_stack_pop_many(int nth, int nit) {
+    constexpr uint32_t N = 1024;
+    FreeIndexStack<uint32_t> st;
+    StackSlots slots{std::vector<uint32_t>(N), std::vector<int>(N, -1)};
+    std::vector<uint32_t> ids(N);
+    std::iota(ids.begin(), ids.end(), 0);
+    st.push_many(ids.data(), N, slots);
+
+    vector<thread> T;
+    for (int i = 0; i < nth; i++) {
+        T.emplace_back(stack_thread, &st, &slots, i, nit);
+    }
+    for (auto &t : T) {
+        t.join();
+    }
+    auto n = st.count();
+    ASSERT(n == N, "Slots lost", n);
+    std::set<uint32_t> uniq;
+    uint32_t i;
+    while (st.pop(i, slots)) {
+        uniq.insert(i);
+    }
+    auto u = uniq.size();
+    ASSERT(u == N, "Stack chain broken", u);
+}
+
+template<class Tobj>
 void many_alloc_thread(int nit) {
     for (int i=0; i<nit; i++) {
-        auto ref = TestObj::allocator.emplace();
+        auto ref = Tobj::allocator.emplace();
         auto u = ref.use();
         u.obj().inc();
     }
 }
 
+template<class Tobj>
 void test_many_alloc(int nth, int nit) {
     vector<thread> T;
     for (int i = 0; i < nth; i++) {
-        T.emplace_back(many_alloc_thread, nit);
+        T.emplace_back(many_alloc_thread<Tobj>, nit);
+    }
+    for (auto &t : T) {
+        t.join();
+    }
+}
+
+// live objects never share a slot
+template<class Tobj>
+void alloc_unique_thread(int tid, int nit) {
+    constexpr int N = 64;
+    for (int i=0; i<nit; i++) {
+        std::unique_ptr<SingleOwnerRefHolder<Tobj>> refs[N];
+        for (int k = 0; k < N; k++) {
+            refs[k].reset(
+                new SingleOwnerRefHolder<Tobj>(Tobj::allocator.emplace())
+            );
+            refs[k]->use().obj().v = tid * N + k;
+        }
+        for (int k = 0; k < N; k++) {
+            auto v = refs[k]->use().obj().v;
+            ASSERT(v == tid * N + k, "Slot shared by two objects", v);
+        }
+    }
+}
+
+template<class Tobj>
+void test_alloc_unique(int nth, int nit) {
+    vector<thread> T;
+    for (int i = 0; i < nth; i++) {
+        T.emplace_back(alloc_unique_thread<Tobj>, i, nit);
     }
     for (auto &t : T) {
         t.join();
@@ -86,6 +506,780 @@ void test_many_inc(int nth, int nit) {
     ASSERT(u.obj().v == nth * nit, "Invalid count", u.obj().v);
 }
 
+template<class Tr>
+void many_read_thread(Tr *v, int nit) {
+    int s = 0;
+    for (int i=0; i<nit; i++) {
+        auto u = v->use_shared();
+        s += u.obj().get();
+    }
+}
+
+void test_many_read(int nth, int nit) {
+    auto ref = TestObjShared::allocator.emplace();
+    {
+        auto u = ref.use();
+        u.obj().inc();
+    }
+    vector<thread> T;
+    for (int i = 0; i < nth; i++) {
+        T.emplace_back(many_read_thread<decltype(ref)>, &ref, nit);
+    }
+    for (auto &t : T) {
+        t.join();
+    }
+    auto u = ref.use_shared();
+    auto v = u.obj().get();
+    ASSERT(v == 1, "Invalid value", v);
+}
+
+// objects allocated on one thread and freed on another
+void test_alloc_cross_thread(int nit) {
+    using ref_t = std::unique_ptr<SingleOwnerRefHolder<TestObjMag>>;
+    constexpr int N = 256;
+    for (int i=0; i<nit; i++) {
+        vector<ref_t> refs(N);
+        thread producer([&refs]() {
+            for (int k = 0; k < N; k++) {
+                refs[k].reset(new SingleOwnerRefHolder<TestObjMag>(
+                    TestObjMag::allocator.emplace()
+                ));
+                refs[k]->use().obj().v = k;
+            }
+        });
+        producer.join();
+        thread consumer([&refs]() {
+            for (int k = 0; k < N; k++) {
+                auto v = refs[k]->use().obj().v;
+                ASSERT(v == k, "Slot shared by two objects", v);
+                refs[k].reset();
+            }
+        });
+        consumer.join();
+    }
+    alloc_unique_thread<TestObjMag>(0, nit);
+}
+
+using move_ref_t = std::unique_ptr<SingleOwnerRefHolder<TestObjMove>>;
+
+void test_compact() {
+    constexpr int N = 10000;
+    vector<move_ref_t> refs(N);
+    for (int k = 0; k < N; k++) {
+        refs[k].reset(new SingleOwnerRefHolder<TestObjMove>(
+            TestObjMove::allocator.emplace()
+        ));
+        refs[k]->use().obj().v = k;
+    }
+    for (int k = 0; k < N; k += 2) {
+        refs[k].reset();
+    }
+    while (TestObjMove::allocator.compact_step(N)) {}
+    for (int k = 1; k < N; k += 2) {
+        auto v = refs[k]->use().obj().v;
+        ASSERT(v == k, "Object value lost on move", v, k);
+    }
+    // forwarding entries are released by use()
+    auto sz = TestObjMove::allocator.used_size();
+    ASSERT(sz == N / 2, "Pool not compacted", sz);
+}
+
+void test_compact_capacity() {
+    using ref_t = std::unique_ptr<SingleOwnerRefHolder<TestObjMoveCap>>;
+    auto &a = TestObjMoveCap::allocator;
+    constexpr int N = 1 << 10;
+    vector<ref_t> refs(N);
+    for (int k = 0; k < N; k++) {
+        refs[k].reset(new SingleOwnerRefHolder<TestObjMoveCap>(a.emplace()));
+        refs[k]->use().obj().v = k;
+    }
+    auto reserved = a.reserved_bytes();
+    ASSERT(reserved < (1 << 20), "Pool reserved past max capacity", reserved);
+    bool full = false;
+    try {
+        auto r = a.emplace();
+    } catch (std::length_error &) {
+        full = true;
+    }
+    ASSERT(full, "Capacity limit not enforced");
+    refs[N / 2].reset();
+    refs[N / 2].reset(new SingleOwnerRefHolder<TestObjMoveCap>(a.emplace()));
+    for (int k = 0; k < N; k += 2) {
+        auto v = refs[k]->use().obj().v;
+        ASSERT(v == (k == N / 2 ? 0 : k), "Object value lost", v, k);
+    }
+}
+
+void compact_thread(int tid, int nit) {
+    constexpr int N = 64;
+    for (int i=0; i<nit; i++) {
+        move_ref_t refs[N];
+        for (int k = 0; k < N; k++) {
+            refs[k].reset(new SingleOwnerRefHolder<TestObjMove>(
+                TestObjMove::allocator.emplace()
+            ));
+            refs[k]->use().obj().v = tid * N + k;
+        }
+        for (int k = 0; k < N; k += 2) {
+            refs[k].reset();
+        }
+        for (int k = 1; k < N; k += 2) {
+            auto u = refs[k]->use();
+            auto v = u.obj().inc();
+            ASSERT(v == tid * N + k + 1, "Object value lost on move", v);
+        }
+    }
+}
+
+void test_compact_background(int nth, int nit) {
+    TestObjMove::allocator.start_compactor(std::chrono::milliseconds(1), 16);
+    vector<thread> T;
+    for (int i = 0; i < nth; i++) {
+        T.emplace_back(compact_thread, i, nit);
+    }
+    for (auto &t : T) {
+        t.join();
+    }
+    TestObjMove::allocator.stop_compactor();
+    auto live = TestObjMove::allocator.live_size();
+    ASSERT(live == 0, "Objects leaked", live);
+}
+
+void test_capacity() {
+    using ref_t = std::unique_ptr<SingleOwnerRefHolder<TestObjCap>>;
+    auto &a = TestObjCap::allocator;
+    auto reserved = a.reserved_bytes();
+    auto committed = a.committed_bytes();
+    ASSERT(committed < reserved, "Capacity is not reserved", committed);
+
+    constexpr int N = 1 << 16;
+    vector<ref_t> refs(N);
+    for (int k = 0; k < N; k++) {
+        refs[k].reset(new SingleOwnerRefHolder<TestObjCap>(a.emplace()));
+        refs[k]->use().obj().v = k;
+    }
+    committed = a.committed_bytes();
+    ASSERT(committed <= reserved, "Pool grew past the reservation", committed);
+    bool full = false;
+    try {
+        auto r = a.emplace();
+    } catch (std::length_error &) {
+        full = true;
+    }
+    ASSERT(full, "Capacity limit not enforced");
+    for (int k = 0; k < N; k++) {
+        auto v = refs[k]->use().obj().v;
+        ASSERT(v == k, "Object value lost on growth", v, k);
+    }
+}
+
+void test_capacity_index() {
+    using small_t = BlockAlloc<TestObjSmall>;
+    using huge_t = BlockAlloc<TestObjHuge>;
+    static_assert(std::is_same<small_t::idx_t, uint16_t>::value);
+    static_assert(std::is_same<huge_t::idx_t, uint64_t>::value);
+    static_assert(std::is_same<BlockAlloc<TestObj>::idx_t, uint32_t>::value);
+    static_assert(sizeof(SingleOwnerRefHolder<TestObjSmall>) == 2);
+    static_assert(block_alloc_capacity_of<uint16_t>::value == UINT16_MAX);
+
+    using ref_t = std::unique_ptr<SingleOwnerRefHolder<TestObjSmall>>;
+    auto &a = TestObjSmall::allocator;
+    constexpr int N = 1000;
+    for (int round = 0; round < 2; round++) {
+        vector<ref_t> refs(N);
+        for (int k = 0; k < N; k++) {
+            refs[k].reset(new SingleOwnerRefHolder<TestObjSmall>(a.emplace()));
+            refs[k]->use().obj().v = k;
+        }
+        bool full = false;
+        try {
+            auto r = a.emplace();
+        } catch (std::length_error &) {
+            full = true;
+        }
+        ASSERT(full, "Compile-time capacity not enforced");
+        for (int k = 0; k < N; k++) {
+            auto v = refs[k]->use().obj().v;
+            ASSERT(v == k, "Narrow index slot shared", v, k);
+        }
+    }
+
+    auto ref = TestObjHuge::allocator.emplace();
+    ref.use().obj().v = 42;
+    auto v = ref.use().obj().v;
+    ASSERT(v == 42, "Wide index object lost", v);
+}
+
+/*
+ * SecureAllocator has no reservation, growing moves the buffer while
+ * other threads allocate and use objects, the free index takes the
+ * allocator lock
+ * */
+template<class Tobj>
+void test_capacity_move(int nth) {
+    using ref_t = std::unique_ptr<SingleOwnerRefHolder<Tobj>>;
+    constexpr int N = 1 << 14;
+    vector<thread> T;
+    for (int t = 0; t < nth; t++) {
+        T.emplace_back([t]() {
+            vector<ref_t> refs(N);
+            for (int k = 0; k < N; k++) {
+                refs[k].reset(new SingleOwnerRefHolder<Tobj>(
+                    Tobj::allocator.emplace()
+                ));
+                refs[k]->use().obj().v = t * N + k;
+                // reused slots in between
+                if (k % 3 == 0) {
+                    refs[k / 2].reset(new SingleOwnerRefHolder<Tobj>(
+                        Tobj::allocator.emplace()
+                    ));
+                    refs[k / 2]->use().obj().v = t * N + k / 2;
+                }
+            }
+            for (int k = 0; k < N; k++) {
+                auto v = refs[k]->use().obj().v;
+                ASSERT(v == t * N + k, "Object value lost on growth", v, k);
+            }
+        });
+    }
+    for (auto &t : T) {
+        t.join();
+    }
+}
+
+size_t rss_bytes() {
+    size_t pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    ASSERT(f, "No /proc/self/statm");
+    ASSERT(fscanf(f, "%zu %zu", &pages, &resident) == 2, "Invalid statm");
+    fclose(f);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+// peak is 10x the steady state, RSS has to follow the live objects
+void test_release_free() {
+    using ref_t = std::unique_ptr<SingleOwnerRefHolder<TestObjBig>>;
+    constexpr int N = 1 << 17;
+    auto before = rss_bytes();
+    vector<ref_t> refs(N);
+    for (int k = 0; k < N; k++) {
+        refs[k].reset(new SingleOwnerRefHolder<TestObjBig>(
+            TestObjBig::allocator.emplace()
+        ));
+    }
+    auto peak = rss_bytes() - before;
+    for (int k = N - 1; k >= N / 10; k--) {
+        refs[k].reset();
+    }
+    auto steady = rss_bytes() - before;
+    ASSERT(steady < peak / 4, "Free tail not released", steady, peak);
+
+    // delete_() leaves less than the 2 * min_bytes gap behind
+    auto left = TestObjBig::allocator.release_free();
+    ASSERT(left < 2 * BLOCK_ALLOC_RELEASE_MIN, "Free tail kept", left);
+    refs.clear();
+    left = TestObjBig::allocator.release_free();
+    ASSERT(left < 2 * BLOCK_ALLOC_RELEASE_MIN, "Free tail kept", left);
+    left = TestObjBig::allocator.release_free();
+    ASSERT(left == 0, "Free tail released twice", left);
+}
+
+// handles stay idle while the pool compacts, RSS has to drop anyway
+void test_compact_release() {
+    using ref_t = std::unique_ptr<SingleOwnerRefHolder<TestObjMoveBig>>;
+    auto &a = TestObjMoveBig::allocator;
+    constexpr int N = 1 << 16;
+    auto before = rss_bytes();
+    vector<ref_t> refs(N);
+    for (int k = 0; k < N; k++) {
+        refs[k].reset(new SingleOwnerRefHolder<TestObjMoveBig>(a.emplace()));
+        refs[k]->use().obj().v = k;
+    }
+    auto peak = rss_bytes() - before;
+    for (int k = 0; k < N; k++) {
+        if (k % 10) {
+            refs[k].reset();
+        }
+    }
+    while (a.compact_step(N)) {}
+    auto steady = rss_bytes() - before;
+    ASSERT(steady < peak / 4, "Moved-out tail not released", steady, peak);
+
+    for (int k = 0; k < N; k += 10) {
+        auto v = refs[k]->use().obj().v;
+        ASSERT(v == k, "Object value lost on move", v, k);
+    }
+    refs.clear();
+    auto size = a.used_size();
+    ASSERT(size == 0, "Pool not empty", size);
+    // delete_() leaves less than the 2 * min_bytes gap behind
+    auto left = a.release_free();
+    ASSERT(left < 2 * BLOCK_ALLOC_RELEASE_MIN, "Free tail kept", left);
+    left = a.release_free();
+    ASSERT(left == 0, "Free tail released twice", left);
+}
+
+struct MagazineSlots {
+    std::vector<uint32_t> links;
+
+    uint32_t &link(uint32_t i) {
+        return links[i];
+    }
+
+    uint32_t grow(uint32_t n) {
+        auto s = links.size();
+        links.resize(s + n);
+        return s;
+    }
+};
+
+// magazines of destroyed indices do not pile up in the thread cache
+void test_magazine_prune(int n) {
+    auto before = rss_bytes();
+    for (int i = 0; i < n; i++) {
+        FreeIndexMagazine<uint32_t> fi;
+        MagazineSlots slots;
+        uint32_t k;
+        fi.pop(k, slots);
+        fi.push(k, slots);
+    }
+    auto grown = rss_bytes() - before;
+    ASSERT(grown < ((size_t)n << 6), "Magazines leaked", grown);
+}
+
+void test_shared_ref() {
+    static_assert(
+        sizeof(SharedRefHolder<TestObjRef>) == sizeof(BlockAlloc<TestObjRef>::idx_t)
+    );
+    WeakRefHolder<TestObjRef> w;
+    {
+        auto a = TestObjRef::allocator.emplace_shared();
+        auto b = a;
+        auto c = std::move(b);
+        ASSERT(!b, "Moved-from handle is not empty");
+        c.use().obj().inc();
+        w = WeakRefHolder<TestObjRef>(a);
+        a = SharedRefHolder<TestObjRef>();
+        auto d = w.lock();
+        ASSERT(d, "Upgrade failed while a strong handle exists");
+        auto v = d.use().obj().v;
+        ASSERT(v == 1, "Invalid value", v);
+    }
+    ASSERT(w.expired(), "Object not deleted with the last strong handle");
+    ASSERT(!w.lock(), "Upgraded a deleted object");
+    auto n = TestObjRef::num_alive;
+    ASSERT(n == 0, "Objects leaked", n);
+}
+
+void shared_ref_thread(SharedRefHolder<TestObjRef> *r, int nit) {
+    for (int i=0; i<nit; i++) {
+        auto c = *r;
+        WeakRefHolder<TestObjRef> w(c);
+        auto u = w.lock();
+        u.use().obj().inc();
+    }
+}
+
+void test_many_shared_ref(int nth, int nit) {
+    auto r = TestObjRef::allocator.emplace_shared();
+    vector<thread> T;
+    for (int i = 0; i < nth; i++) {
+        T.emplace_back(shared_ref_thread, &r, nit);
+    }
+    for (auto &t : T) {
+        t.join();
+    }
+    auto v = r.use().obj().v;
+    ASSERT(v == nth * nit, "Invalid count", v);
+}
+
+template<class Tr>
+void seq_read_thread(Tr *v, int nit) {
+    for (int i=0; i<nit; i++) {
+        auto o = v->read();
+        auto s = o.a + o.b;
+        ASSERT(s == 0, "Torn optimistic read", o.a, o.b);
+    }
+}
+
+void test_seq_read(int nth, int nit) {
+    auto ref = TestObjSeq::allocator.emplace();
+    vector<thread> T;
+    T.emplace_back([&ref, nit]() {
+        for (int i=0; i<nit; i++) {
+            auto u = ref.use();
+            u.obj().inc();
+        }
+    });
+    for (int i = 0; i < nth; i++) {
+        T.emplace_back(seq_read_thread<decltype(ref)>, &ref, nit);
+    }
+    for (auto &t : T) {
+        t.join();
+    }
+    auto a = ref.read().a;
+    ASSERT(a == nit, "Invalid count", a);
+}
+
+void test_soa() {
+    auto a = TestSoa::allocator.emplace(1.5, 2, 3);
+    std::unique_ptr<SingleOwnerRefHolder<TestSoa>> b(
+        new SingleOwnerRefHolder<TestSoa>(TestSoa::allocator.emplace(0, 0, 0))
+    );
+    auto c = TestSoa::allocator.emplace(0, 0, 0);
+    {
+        auto u = c.use();
+        u.get<TestSoa::Qty>() = 10;
+        u.get<TestSoa::Price>() += 0.5;
+    }
+    {
+        auto u = a.use();
+        auto qty = u.get<TestSoa::Qty>();
+        auto id = u.get<TestSoa::Id>();
+        ASSERT(qty == 2 && id == 3, "Wrong fields", qty, id);
+    }
+
+    auto ib = b->index();
+    b.reset();
+    auto qtys = TestSoa::allocator.column<TestSoa::Qty>();
+    ASSERT(qtys[ib] == 0, "Free slot kept its fields");
+    int sum = std::accumulate(qtys.begin(), qtys.end(), 0);
+    ASSERT(sum == 12, "Wrong column sum", sum);
+
+    auto ic = c.index();
+    c.reposition();
+    auto new_ic = c.index();
+    ASSERT(new_ic < ic, "Object was not repositioned", ic, new_ic);
+    auto u = c.use();
+    auto qty = u.get<TestSoa::Qty>();
+    auto price = u.get<TestSoa::Price>();
+    ASSERT(qty == 10 && price == 0.5, "Fields lost on reposition", qty);
+}
+
+// columns without a reservation move on growth
+void test_soa_move(int nth) {
+    using ref_t = std::unique_ptr<SingleOwnerRefHolder<TestSoaSecure>>;
+    constexpr int N = 1 << 14;
+    vector<thread> T;
+    for (int t = 0; t < nth; t++) {
+        T.emplace_back([t]() {
+            vector<ref_t> refs(N);
+            for (int k = 0; k < N; k++) {
+                refs[k].reset(new SingleOwnerRefHolder<TestSoaSecure>(
+                    TestSoaSecure::allocator.emplace(k, t)
+                ));
+            }
+            for (int k = 0; k < N; k++) {
+                auto u = refs[k]->use();
+                auto qty = u.get<TestSoaSecure::Qty>();
+                auto id = u.get<TestSoaSecure::Id>();
+                ASSERT(qty == k && id == t, "Fields lost on growth", qty, id);
+            }
+        });
+    }
+    for (auto &t : T) {
+        t.join();
+    }
+}
+
+template<IterLock mode>
+long sum_live(ThreadPool *pool = NULL) {
+    long sum = 0;
+    if (pool) {
+        TestObjIter::allocator.parallel_for_each<mode>(*pool,
+            [&sum](unsigned, TestObjIter &o) {
+                __atomic_fetch_add(&sum, o.v, __ATOMIC_RELAXED);
+            }
+        );
+    } else {
+        TestObjIter::allocator.for_each<mode>(
+            [&sum](unsigned, TestObjIter &o) {
+                sum += o.v;
+            }
+        );
+    }
+    return sum;
+}
+
+void test_for_each() {
+    using ref_t = std::unique_ptr<SingleOwnerRefHolder<TestObjIter>>;
+    constexpr int N = 200000;
+    std::vector<ref_t> refs;
+    long expected = 0;
+    for (int i = 0; i < N; i++) {
+        refs.emplace_back(new SingleOwnerRefHolder<TestObjIter>(
+            TestObjIter::allocator.emplace()
+        ));
+        refs.back()->use().obj().v = i;
+        expected += i;
+    }
+    // free slots in the middle of words and whole empty chunks
+    for (int i = 0; i < N; i++) {
+        if (i % 3 == 0 || (i > 5000 && i < 9000)) {
+            expected -= i;
+            refs[i].reset();
+        }
+    }
+
+    ThreadPool pool(3);
+    long sums[] = {
+        sum_live<IterLock::OBJECT>(), sum_live<IterLock::CHUNK>(),
+        sum_live<IterLock::NONE>(), sum_live<IterLock::OBJECT>(&pool),
+        sum_live<IterLock::NONE>(&pool)
+    };
+    for (auto sum : sums) {
+        ASSERT(sum == expected, "Wrong sum of live objects", sum, expected);
+    }
+
+    auto begin = refs[1]->index();
+    auto end = refs[5]->index();
+    int n = 0;
+    TestObjIter::allocator.for_each_range(begin, end,
+        [&n](unsigned, TestObjIter &) {
+            n++;
+        }
+    );
+    ASSERT(n == 3, "Wrong number of objects in range", n);
+}
+
+// objects of test_scan, shared by all modes
+std::vector<std::unique_ptr<SingleOwnerRefHolder<TestObjIter>>> scan_refs;
+
+// full scan of `n` live objects by `nth` threads, `nit` times
+template<IterLock mode>
+void test_scan(int nth, int n, int nit) {
+    auto &refs = scan_refs;
+    ThreadPool pool(nth - 1);
+    while ((int)refs.size() < n) {
+        refs.emplace_back(new SingleOwnerRefHolder<TestObjIter>(
+            TestObjIter::allocator.emplace()
+        ));
+        refs.back()->use().obj().v = 1;
+    }
+    for (int it = 0; it < nit; it++) {
+        auto sum = sum_live<mode>(nth > 1 ? &pool : NULL);
+        ASSERT(sum == n, "Wrong sum of live objects", sum, n);
+    }
+}
+
+template<class Tobj>
+void test_batch() {
+    constexpr int N = 100;
+    unsigned ids[N];
+    Tobj::allocator.emplace_many(ids, N);
+    std::set<unsigned> uniq(ids, ids + N);
+    auto n = uniq.size();
+    ASSERT(n == N, "Batch handed out a slot twice", n);
+
+    Tobj::allocator.use_many(ids, N, [](unsigned, Tobj &o) {
+        o.inc();
+    });
+    for (int k = 0; k < N; k++) {
+        auto v = Tobj::allocator.use(ids[k]).obj().v;
+        ASSERT(v == 1, "Object missed by use_many", k, v);
+    }
+    Tobj::allocator.delete_many(ids, N);
+
+    auto cap = Tobj::allocator.get_capacity();
+    Tobj::allocator.emplace_many(ids, N);
+    auto new_cap = Tobj::allocator.get_capacity();
+    ASSERT(new_cap == cap, "Freed slots were not reused", cap, new_cap);
+    Tobj::allocator.delete_many(ids, N);
+}
+
+// `nobj` objects created, touched and deleted `batch` at a time
+template<class Tobj>
+void test_many_batch(int batch, int nobj) {
+    std::vector<unsigned> ids(batch);
+    for (int done = 0; done < nobj; done += batch) {
+        Tobj::allocator.emplace_many(ids.data(), batch);
+        Tobj::allocator.use_many(ids.data(), batch, [](unsigned, Tobj &o) {
+            o.inc();
+        });
+        Tobj::allocator.delete_many(ids.data(), batch);
+    }
+}
+
+// batches of several threads never share a slot
+template<class Tobj>
+void batch_thread(int tid, int nit) {
+    constexpr int N = 64;
+    unsigned ids[N];
+    for (int i = 0; i < nit; i++) {
+        Tobj::allocator.emplace_many(ids, N);
+        Tobj::allocator.use_many(ids, N, [tid](unsigned, Tobj &o) {
+            o.v = tid;
+        });
+        Tobj::allocator.use_many(ids, N, [tid](unsigned k, Tobj &o) {
+            auto v = o.v;
+            ASSERT(v == tid, "Slot shared by two batches", k, v);
+        });
+        Tobj::allocator.delete_many(ids, N);
+    }
+}
+
+template<class Tobj>
+void test_batch_threads(int nth, int nit) {
+    vector<thread> T;
+    for (int i = 0; i < nth; i++) {
+        T.emplace_back(batch_thread<Tobj>, i, nit);
+    }
+    for (auto &t : T) {
+        t.join();
+    }
+}
+
+void test_epoch_retire() {
+    constexpr int N = 1000;
+    EpochDomain d;
+    int freed = 0;
+    auto count = [](void *ctx, uint64_t) {
+        (*(int*)ctx)++;
+    };
+    bool pinned = false;
+    bool done = false;
+    thread reader([&]() {
+        auto g = d.pin();
+        __atomic_store_n(&pinned, true, __ATOMIC_RELEASE);
+        while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+            this_thread::yield();
+        }
+    });
+    while (!__atomic_load_n(&pinned, __ATOMIC_ACQUIRE)) {
+        this_thread::yield();
+    }
+    for (int i = 0; i < N; i++) {
+        d.retire(count, &freed, i);
+    }
+    d.synchronize();
+    ASSERT(freed == 0, "Freed under a pinned reader", freed);
+
+    __atomic_store_n(&done, true, __ATOMIC_RELEASE);
+    reader.join();
+    auto all = d.synchronize();
+    ASSERT(all && freed == N, "Retired objects were not freed", freed);
+}
+
+// readers peek at published objects while a writer replaces them
+void test_epoch_readers(int nth, int nit) {
+    constexpr int N = 64;
+    auto &a = TestObjEpoch::allocator;
+    EpochDomain d;
+    unsigned published[N];
+    a.emplace_many(published, N);
+
+    vector<thread> T;
+    for (int t = 0; t < nth; t++) {
+        T.emplace_back([&]() {
+            unsigned seen[N];
+            for (int it = 0; it < nit / N; it++) {
+                auto g = d.pin();
+                for (int k = 0; k < N; k++) {
+                    seen[k] = __atomic_load_n(&published[k], __ATOMIC_ACQUIRE);
+                }
+                // let the writer retire what we hold
+                this_thread::yield();
+                for (int k = 0; k < N; k++) {
+                    auto v = a.peek(seen[k]).v;
+                    ASSERT(v == TestObjEpoch::MAGIC, "Object freed under reader", v);
+                }
+            }
+        });
+    }
+    for (int it = 0; it < nit / N; it++) {
+        unsigned i;
+        a.emplace_many(&i, 1);
+        auto old = __atomic_exchange_n(
+            &published[it % N], i, __ATOMIC_ACQ_REL
+        );
+        a.delete_deferred(old, d);
+        this_thread::yield();
+    }
+    for (auto &t : T) {
+        t.join();
+    }
+    a.delete_many(published, N);
+}
+
+template<class Tpacked>
+void test_gen_ref() {
+    using gen_t = GenRef<TestObjGen, Tpacked>;
+    auto packed_size = sizeof(gen_t);
+    ASSERT(packed_size == sizeof(Tpacked), "Handle is not packed", packed_size);
+    ASSERT(!gen_t().valid(), "Default handle is valid");
+
+    gen_t g;
+    unsigned i;
+    {
+        auto ref = TestObjGen::allocator.emplace();
+        g = ref.template gen_ref<Tpacked>();
+        i = ref.index();
+        ASSERT(g.valid(), "Fresh handle is invalid");
+        auto u = g.try_use();
+        ASSERT((bool)u, "try_use() failed on a live object");
+        u.obj().inc();
+    }
+    ASSERT(!g.valid(), "Handle of a deleted object is valid");
+    ASSERT(!g.try_use(), "try_use() succeeded on a deleted object");
+
+    // the slot is reused right away
+    auto ref = TestObjGen::allocator.emplace();
+    auto j = ref.index();
+    ASSERT(i == j, "Slot was not reused", i, j);
+    ASSERT(!g.valid(), "Stale handle aliases the new object");
+    auto g2 = ref.template gen_ref<Tpacked>();
+    ASSERT(g2.valid() && !(g2 == g), "New handle is wrong");
+    auto v = g2.try_use().obj().v;
+    ASSERT(v == 0, "New handle sees the old object", v);
+}
+
+// lock-free validity check against a stripe lock per access
+template<bool lock_free>
+void test_many_gen_check(int nit) {
+    auto ref = TestObjGen::allocator.emplace();
+    auto g = ref.gen_ref();
+    int n = 0;
+    for (int i = 0; i < nit; i++) {
+        if (lock_free) {
+            n += g.valid();
+        } else {
+            n += (bool)g.try_use();
+        }
+    }
+    ASSERT(n == nit, "Live object reported stale", n);
+}
+
+// sums one field over `n` objects `nit` times, objects are kept across runs
+template<bool soa>
+void test_column_sum(int n, int nit) {
+    static std::vector<std::unique_ptr<SingleOwnerRefHolder<TestSoa>>> refs;
+    static std::vector<TestAos> aos;
+    for (int i = soa ? refs.size() : aos.size(); i < n; i++) {
+        if (soa) {
+            refs.emplace_back(new SingleOwnerRefHolder<TestSoa>(
+                TestSoa::allocator.emplace(i * 0.5, i, i)
+            ));
+        } else {
+            aos.push_back({i * 0.5, i, i, {}});
+        }
+    }
+    long sum = 0;
+    for (int it = 0; it < nit; it++) {
+        if (soa) {
+            auto qtys = TestSoa::allocator.column<TestSoa::Qty>();
+            for (size_t i = 0; i < qtys.size(); i++) {
+                sum += qtys[i];
+            }
+        } else {
+            for (auto &o : aos) {
+                sum += o.qty;
+            }
+        }
+    }
+    long expected = (long)n * (n - 1) / 2 * nit;
+    ASSERT(sum == expected, "Wrong sum", sum, expected);
+}
+
 //template<class Tl, class Ta>
 //void many_inc_thread_arg(Tl *v, Ta arg, int nit) {
     //for (int i=0; i<nit; i++) {
@@ -109,10 +1303,88 @@ void test_many_inc(int nth, int nit) {
 
 int test() {
     TEST(test_alloc).run();
+    TEST(test_reposition<TestObj>).run();
+    TEST(test_reposition<TestObjDense>).run();
+    TEST(test_reposition<TestObjTree>).run();
+    TEST(test_capacity).run();
+    TEST(test_capacity_move<TestObjSecure>).run(4);
+    TEST(test_capacity_move<TestObjSecureTree>).run(4);
+    TEST(test_capacity_index).run();
+    TEST(test_release_free).run();
+    TEST(test_magazine_prune).run(1e5);
+    TEST(test_shared_ref).run();
+    TEST(test_compact).run();
+    TEST(test_compact_capacity).run();
+    TEST(test_compact_release).run();
+    TEST(test_soa).run();
+    TEST(test_soa_move).run(4);
+    TEST(test_for_each).run();
+    TEST(test_batch<TestObj>).run();
+    TEST(test_batch<TestObjDense>).run();
+    TEST(test_batch<TestObjTree>).run();
+    TEST(test_batch<TestObjMag>).run();
+    TEST(test_batch_threads<TestObj>).run(8, 1e4);
+    TEST(test_batch_threads<TestObjDense>).run(8, 1e4);
+    TEST(test_batch_threads<TestObjTree>).run(8, 1e4);
+    TEST(test_batch_threads<TestObjMag>).run(8, 1e4);
+    TEST(test_epoch_retire).run();
+    TEST(test_gen_ref<uint64_t>).run();
+    TEST(test_gen_ref<uint32_t>).run();
+    TEST(test_epoch_readers).run(4, 1e6);
+    TEST(test_compact_background).run(10, 1e3);
+    TEST(test_bit_tree).run(64, 1e4).run(5000, 1e4);
+    TEST(test_bit_tree_first_free).benchmark(50, 1 << 22, 1e6);
+    TEST(test_alloc_unique<TestObj>).run(10, 1e3);
+    TEST(test_alloc_unique<TestObjMag>).run(10, 1e3);
+    TEST(test_alloc_cross_thread).run(100);
+    TEST(test_stack_pop_many).run(8, 1e6);
     TEST(test_many_inc)
         .benchmark(50, 1, 1e6)
         .benchmark(50, 10, 1e6);
-    TEST(test_many_alloc)
+    TEST(test_many_read)
+        .benchmark(50, 1, 1e6)
+        .benchmark(50, 10, 1e6);
+    TEST(test_many_shared_ref)
+        .benchmark(50, 1, 1e6)
+        .benchmark(50, 10, 1e6);
+    TEST(test_seq_read)
+        .benchmark(50, 1, 1e6)
+        .benchmark(50, 10, 1e6);
+    TEST(test_scan<IterLock::OBJECT>).benchmark(10, 1, 4e6, 5);
+    TEST(test_scan<IterLock::CHUNK>).benchmark(10, 1, 4e6, 5);
+    TEST(test_scan<IterLock::NONE>)
+        .benchmark(10, 1, 4e6, 5)
+        .benchmark(10, 4, 4e6, 5);
+    TEST(test_epoch_readers)
+        .benchmark(10, 1, 1e6)
+        .benchmark(10, 10, 1e6);
+    TEST(test_many_gen_check<true>).benchmark(10, 1e7);
+    TEST(test_many_gen_check<false>).benchmark(10, 1e7);
+    TEST(test_many_batch<TestObj>)
+        .benchmark(10, 1, 1 << 20)
+        .benchmark(10, 16, 1 << 20)
+        .benchmark(10, 256, 1 << 20)
+        .benchmark(10, 4096, 1 << 20);
+    TEST(test_many_batch<TestObjDense>)
+        .benchmark(10, 1, 1 << 20)
+        .benchmark(10, 16, 1 << 20)
+        .benchmark(10, 256, 1 << 20)
+        .benchmark(10, 4096, 1 << 20);
+    TEST(test_column_sum<false>).benchmark(10, 1e6, 100);
+    TEST(test_column_sum<true>).benchmark(10, 1e6, 100);
+    TEST(test_many_alloc<TestObj>)
+        .benchmark(50, 1, 1e6)
+        .benchmark(50, 10, 1e6);
+    TEST(test_many_alloc<TestObjMag>)
+        .benchmark(50, 1, 1e6)
+        .benchmark(50, 10, 1e6);
+    TEST(test_many_alloc<TestObjTree>)
+        .benchmark(50, 1, 1e6)
+        .benchmark(50, 10, 1e6);
+    TEST(test_many_alloc<TestObjDense>)
+        .benchmark(50, 1, 1e6)
+        .benchmark(50, 10, 1e6);
+    TEST(test_many_alloc<TestObjSmall>)
         .benchmark(50, 1, 1e6)
         .benchmark(50, 10, 1e6);
     return 0;
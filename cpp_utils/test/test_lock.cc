@@ -1,9 +1,15 @@
+#include <mem/cond_var.h>
 #include <mem/lock.h>
+#include <mem/lock_compact.h>
 #include <mem/lock_set.h>
 #include <mem/lock_pool.h>
+#include <mem/lock_queue.h>
+#include <mem/lock_shared.h>
 #include <utils/test.h>
 
+#include <chrono>
 #include <iostream>
+#include <sstream>
 #include <vector>
 #include <thread>
 
@@ -15,16 +21,61 @@ class SyncInt : public LockObject {
     volatile int v = 0;
 };
 
+class SyncIntAdaptive : public AdaptiveLockObject {
+    public:
+    volatile int v = 0;
+};
+
+class SyncIntCompact : public CompactLockObject {
+    public:
+    volatile int v = 0;
+};
+
+class SyncIntTicket : public TicketLock {
+    public:
+    volatile int v = 0;
+};
+
+class SyncIntMCS : public MCSLock {
+    public:
+    volatile int v = 0;
+};
+
+class SyncIntShared : public SharedLockObject {
+    public:
+    volatile int v = 0;
+};
+
 class SyncIntSet : public SetLock<int> {
     public:
     volatile int v = 0;
 };
 
+class SyncIntSetCompact : public SetLock<int, CompactLockObject> {
+    public:
+    volatile int v = 0;
+};
+
 class SyncIntPool : public PoolLock<int, 16> {
     public:
     volatile int v = 0;
 };
 
+class SyncIntPoolAdaptive : public PoolLock<int, 16, AdaptiveLockObject> {
+    public:
+    volatile int v = 0;
+};
+
+class SyncIntPoolMCS : public PoolLock<int, 16, MCSLock> {
+    public:
+    volatile int v = 0;
+};
+
+class SyncIntPoolCompact : public PoolLock<int, 16, CompactLockObject> {
+    public:
+    volatile int v = 0;
+};
+
 template<class Tl>
 void many_inc_thread(Tl *v, int nit) {
     for (int i=0; i<nit; i++) {
@@ -33,8 +84,9 @@ void many_inc_thread(Tl *v, int nit) {
     }
 }
 
+template<class Tl>
 void test_many_inc(int nth, int nit) {
-    SyncInt v;
+    Tl v;
     vector<thread> T;
     for (int i = 0; i < nth; i++) {
         T.emplace_back(many_inc_thread<decltype(v)>, &v, nit);
@@ -45,6 +97,159 @@ void test_many_inc(int nth, int nit) {
     ASSERT(v.v == nth * nit, "Invalid count", v.v);
 }
 
+// one write per `read_ratio` reads
+template<class Tl>
+void many_read_thread(Tl *v, int nit, int read_ratio) {
+    int s = 0;
+    for (int i=0; i<nit; i++) {
+        if (i % read_ratio) {
+            if constexpr (std::is_base_of<SharedLockObject, Tl>::value) {
+                auto l = v->lock_shared();
+                s += v->v;
+            } else {
+                auto l = v->lock();
+                s += v->v;
+            }
+        } else {
+            auto l = v->lock();
+            v->v++;
+        }
+    }
+}
+
+template<class Tl>
+void test_many_read(int nth, int nit) {
+    constexpr int read_ratio = 16;
+    Tl v;
+    vector<thread> T;
+    for (int i = 0; i < nth; i++) {
+        T.emplace_back(many_read_thread<Tl>, &v, nit, read_ratio);
+    }
+    for (auto &t : T) {
+        t.join();
+    }
+    int writes = nth * ((nit + read_ratio - 1) / read_ratio);
+    ASSERT(v.v == writes, "Invalid count", v.v, writes);
+}
+
+class SyncIntPoolPair : public PoolLock<int, 16> {
+    public:
+    volatile int v[2] = {0, 0};
+};
+
+// half of the threads take keys in reverse order
+void many_inc_pair_thread(SyncIntPoolPair *v, bool reverse, int nit) {
+    for (int i=0; i<nit; i++) {
+        auto l = reverse ? v->lock_many(1, 0) : v->lock_many(0, 1);
+        v->v[0]++;
+        v->v[1]++;
+    }
+}
+
+void test_many_inc_pair(int nth, int nit) {
+    SyncIntPoolPair v;
+    vector<thread> T;
+    for (int i = 0; i < nth; i++) {
+        T.emplace_back(many_inc_pair_thread, &v, i & 1, nit);
+    }
+    for (auto &t : T) {
+        t.join();
+    }
+    int a = v.v[0], b = v.v[1];
+    ASSERT(a == nth * nit && b == nth * nit, "Invalid count", a, b);
+}
+
+template<class Tl>
+void acquire_latency_thread(Tl *v, int nit, vector<uint64_t> *lat) {
+    lat->reserve(nit);
+    for (int i=0; i<nit; i++) {
+        auto start = std::chrono::steady_clock::now();
+        v->lock_c();
+        auto end = std::chrono::steady_clock::now();
+        v->v++;
+        v->unlock_c();
+        lat->push_back(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()
+        );
+    }
+}
+
+template<class Tl>
+void test_acquire_latency(int nth, int nit) {
+    Tl v;
+    vector<vector<uint64_t>> L(nth);
+    vector<thread> T;
+    for (int i = 0; i < nth; i++) {
+        T.emplace_back(acquire_latency_thread<Tl>, &v, nit, &L[i]);
+    }
+    for (auto &t : T) {
+        t.join();
+    }
+    ASSERT(v.v == nth * nit, "Invalid count", v.v);
+
+    vector<uint64_t> all;
+    for (auto &l : L) {
+        all.insert(all.end(), l.begin(), l.end());
+    }
+    std::sort(all.begin(), all.end());
+    INFO(test) << typeid(Tl).name() << " acquire latency:: "
+        << "p50: " << all[all.size() / 2] << "ns; "
+        << "p99: " << all[all.size() * 99 / 100] << "ns; "
+        << "max: " << all.back() << "ns" << LOG_ENDL;
+}
+
+template<class Tl>
+class SyncQueue : public Tl {
+    public:
+    CondVar cond;
+    int items = 0;
+    int consumed = 0;
+};
+
+template<class Tq>
+void queue_consumer_thread(Tq *q, int nit) {
+    for (int i=0; i<nit; i++) {
+        auto l = q->lock();
+        q->cond.wait(*q, [&]() { return q->items > 0; });
+        q->items--;
+        q->consumed++;
+    }
+}
+
+template<class Tl>
+void test_cond_queue(int nth, int nit) {
+    SyncQueue<Tl> q;
+    vector<thread> T;
+    for (int i = 0; i < nth; i++) {
+        T.emplace_back(queue_consumer_thread<decltype(q)>, &q, nit);
+    }
+    for (int i = 0; i < nth * nit; i++) {
+        auto l = q.lock();
+        q.items++;
+        if (i % 64) {
+            q.cond.notify_one();
+        } else {
+            q.cond.notify_all(q);
+        }
+    }
+    for (auto &t : T) {
+        t.join();
+    }
+    ASSERT(q.consumed == nth * nit, "Invalid count", q.consumed);
+}
+
+void test_cond_timeout() {
+    SyncQueue<CompactLockObject> q;
+    auto l = q.lock();
+    auto start = std::chrono::steady_clock::now();
+    bool r = q.cond.wait_for(q, std::chrono::milliseconds(20), [&]() {
+        return q.items > 0;
+    });
+    auto waited = std::chrono::steady_clock::now() - start;
+    ASSERT(!r, "Wait should time out");
+    ASSERT(waited >= std::chrono::milliseconds(20), "Wait returned too early");
+}
+
 template<class Tl, class Ta>
 void many_inc_thread_arg(Tl *v, Ta arg, int nit) {
     for (int i=0; i<nit; i++) {
@@ -66,10 +271,95 @@ void test_many_inc_arg(int nth, int nit) {
     ASSERT(v.v == nth * nit, "Invalid count", v.v);
 }
 
+// every thread on one stripe, held at first so they have to wait
+void test_lock_stats(int nth, int nit) {
+    SyncIntPool v;
+    v.set_lock_name("pool");
+    vector<thread> T;
+    { // scope for lock
+        auto l = v.lock(0);
+        for (int i = 0; i < nth; i++) {
+            T.emplace_back(many_inc_thread_arg<decltype(v), int>, &v, 0, nit);
+        }
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    for (auto &t : T) {
+        t.join();
+    }
+    auto dump = lock_stats_dump(-1);
+    INFO(test) << "Lock stats:\n" << dump << LOG_ENDL;
+#ifdef LOCK_STATS
+    uint64_t acquisitions = 0, contended = 0;
+    istringstream is(dump);
+    string line;
+    while (getline(is, line)) {
+        if (line.rfind("pool[", 0)) {
+            continue;
+        }
+        string name;
+        uint64_t a = 0, c = 0;
+        istringstream(line) >> name >> a >> c;
+        acquisitions += a;
+        contended += c;
+    }
+    ASSERT(acquisitions >= (uint64_t)nth * nit, "Acquisitions lost",
+        acquisitions);
+    ASSERT(contended > 0, "No contended acquisition", contended);
+#else
+    ASSERT(dump == "lock stats disabled, build with -DLOCK_STATS\n",
+        "Stats without LOCK_STATS", dump);
+#endif
+}
+
+// try_lock_c() fails while another thread holds the lock
+template<class Tl>
+void test_try_lock() {
+    Tl l;
+    bool got = l.try_lock_c();
+    ASSERT(got, "Free lock not taken");
+    std::thread t([&]() {
+        got = l.try_lock_c();
+    });
+    t.join();
+    ASSERT(!got, "Held lock taken twice");
+    l.unlock_c();
+    t = std::thread([&]() {
+        got = l.try_lock_c();
+        if (got) {
+            l.unlock_c();
+        }
+    });
+    t.join();
+    ASSERT(got, "Released lock not taken");
+}
+
 int test() {
     INFO(test) << "Object size: " << sizeof(LockObject) << DBG_ENDL;
-    TEST(test_many_inc).benchmark(50, 10, 1e6);
-    TEST(test_many_inc_arg<SyncIntSet>).benchmark(10, 10, 1e5);
+    INFO(test) << "Compact object size: " << sizeof(CompactLockObject) << DBG_ENDL;
+    TEST(test_many_inc<SyncInt>).benchmark(50, 1, 1e6).benchmark(50, 10, 1e6);
+    TEST(test_many_inc<SyncIntAdaptive>).benchmark(50, 1, 1e6).benchmark(50, 10, 1e6);
+    TEST(test_many_inc<SyncIntCompact>).benchmark(50, 1, 1e6).benchmark(50, 10, 1e6);
+    TEST(test_many_inc<SyncIntTicket>).benchmark(50, 1, 1e6).benchmark(10, 10, 1e5);
+    TEST(test_many_inc<SyncIntMCS>).benchmark(50, 1, 1e6).benchmark(10, 10, 1e5);
+    TEST(test_acquire_latency<SyncInt>).run(10, 1e4);
+    TEST(test_acquire_latency<SyncIntAdaptive>).run(10, 1e4);
+    TEST(test_acquire_latency<SyncIntCompact>).run(10, 1e4);
+    TEST(test_acquire_latency<SyncIntTicket>).run(10, 1e4);
+    TEST(test_acquire_latency<SyncIntMCS>).run(10, 1e4);
+    TEST(test_many_read<SyncInt>).benchmark(50, 10, 1e6);
+    TEST(test_many_read<SyncIntShared>).benchmark(50, 10, 1e6);
+    TEST(test_many_inc_arg<SyncIntSet>).benchmark(50, 10, 1e6);
+    TEST(test_many_inc_arg<SyncIntSetCompact>).benchmark(50, 10, 1e6);
     TEST(test_many_inc_arg<SyncIntPool>).benchmark(50, 10, 1e6);
+    TEST(test_many_inc_arg<SyncIntPoolAdaptive>).benchmark(50, 10, 1e6);
+    TEST(test_many_inc_arg<SyncIntPoolCompact>).benchmark(50, 10, 1e6);
+    TEST(test_many_inc_arg<SyncIntPoolMCS>).benchmark(10, 10, 1e5);
+    TEST(test_cond_queue<LockObject>).benchmark(10, 10, 1e5);
+    TEST(test_cond_queue<CompactLockObject>).benchmark(10, 10, 1e5);
+    TEST(test_cond_timeout).run();
+    TEST(test_try_lock<LockObject>).run();
+    TEST(test_try_lock<SharedLockObject>).run();
+    TEST(test_many_inc_pair).benchmark(50, 10, 1e6);
+    TEST(test_lock_stats).run(10, 1e5);
     return 0;
 }
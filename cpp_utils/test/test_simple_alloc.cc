@@ -0,0 +1,54 @@
+#include "mem/simple_alloc.h"
+
+#include "utils/test.h"
+
+#include <random>
+
+using namespace std;
+
+template<class Talloc>
+void log_mode(Talloc &a) {
+    INFO(test) << "page mode: " << page_mode_str(a.page_mode())
+        << ", page size: " << a.page_size() << LOG_ENDL;
+}
+
+// random increments over a `size` byte buffer, TLB miss bound
+template<class PagePolicy>
+void test_random_access(size_t size, int nit) {
+    SimpleAllocatorT<PagePolicy> a(size);
+    auto *data = (uint64_t*)a.get_data();
+    auto n = size / sizeof(uint64_t);
+    std::fill(data, data + n, 0);
+
+    std::minstd_rand rng(42);
+    for (int i = 0; i < nit; i++) {
+        data[rng() % n]++;
+    }
+}
+
+template<class PagePolicy>
+void test_page_mode() {
+    SimpleAllocatorT<PagePolicy> a(1 << 20, 64 << 20);
+    log_mode(a);
+    auto reserved = a.reserved_bytes();
+    auto page = a.page_size();
+    ASSERT(reserved % page == 0, "Reservation is not page aligned", reserved);
+    auto addr = (size_t)a.get_data();
+    ASSERT(addr % page == 0, "Mapping is not page aligned", addr);
+
+    a.resize(32 << 20);
+    auto *data = (char*)a.get_data();
+    std::fill(data, data + (32 << 20), 1);
+    a.release(0, 32 << 20);
+    ASSERT(data[0] == 0, "Released page kept its data");
+}
+
+int test() {
+    TEST(test_page_mode<PagesNormal>).run();
+    TEST(test_page_mode<PagesTHP>).run();
+    TEST(test_page_mode<PagesHugeTLB>).run();
+    TEST(test_random_access<PagesNormal>).benchmark(10, 1ul << 30, 1e7);
+    TEST(test_random_access<PagesTHP>).benchmark(10, 1ul << 30, 1e7);
+    TEST(test_random_access<PagesHugeTLB>).benchmark(10, 1ul << 30, 1e7);
+    return 0;
+}
@@ -0,0 +1,176 @@
+#include "mem/slab_alloc.h"
+
+#include "utils/test.h"
+
+#include <cstring>
+#include <list>
+#include <map>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+using Slab = SlabAlloc<>;
+
+void test_size_class() {
+    for (size_t n = 1; n <= SLAB_MAX_SIZE; n++) {
+        auto c = Slab::size_class(n);
+        auto size = Slab::class_size(c);
+        ASSERT(size >= n, "Class too small", n, size);
+        auto prev = c ? Slab::class_size(c - 1) : 0;
+        ASSERT(prev < n, "Class not the tightest", n, size);
+    }
+    auto c24 = Slab::class_size(1);
+    ASSERT(c24 == 24, "Wrong half class", c24);
+}
+
+void test_slab_alloc() {
+    Slab slab;
+    std::minstd_rand rng(42);
+    std::vector<std::pair<char*, size_t>> blocks;
+    for (int i = 0; i < 100000; i++) {
+        size_t n = rng() % 2048 + 1;
+        auto *p = (char*)slab.alloc(n);
+        auto natural = std::min<size_t>(n & -n, 16);
+        ASSERT((size_t)p % natural == 0, "Misaligned block", n);
+        memset(p, i & 0xff, n);
+        blocks.push_back({p, n});
+        if (rng() % 3 == 0) {
+            auto k = rng() % blocks.size();
+            std::swap(blocks[k], blocks.back());
+            auto [q, m] = blocks.back();
+            auto fill = q[m - 1];
+            for (size_t j = 0; j < m; j++) {
+                ASSERT(q[j] == fill, "Block overwritten", j, m);
+            }
+            slab.free(q);
+            blocks.pop_back();
+        }
+    }
+    auto *aligned = slab.alloc(24, 64);
+    ASSERT((size_t)aligned % 64 == 0, "Alignment ignored");
+    slab.free(aligned);
+
+    auto *large = slab.alloc(SLAB_MAX_SIZE + 1);
+    slab.free(large);
+
+    for (auto [p, n] : blocks) {
+        slab.free(p);
+    }
+}
+
+void test_slab_cross_thread() {
+    Slab slab;
+    std::vector<void*> blocks;
+    for (int i = 0; i < 10000; i++) {
+        blocks.push_back(slab.alloc(40));
+    }
+    std::thread t([&]() {
+        for (auto *p : blocks) {
+            slab.free(p);
+        }
+    });
+    t.join();
+    // the exited thread handed the slots back
+    auto committed = slab.committed_bytes();
+    for (int i = 0; i < 10000; i++) {
+        slab.alloc(40);
+    }
+    auto after = slab.committed_bytes();
+    ASSERT(after == committed, "Freed slots were not reused", after);
+}
+
+// tiny magazines, blocks go through the shared free stack all the time
+// while their first word, the free link, holds user data
+void slab_churn_thread(SlabAlloc<4> *slab, char fill, int nit) {
+    constexpr int N = 16;
+    char *blocks[N];
+    for (int i = 0; i < nit; i++) {
+        for (int k = 0; k < N; k++) {
+            blocks[k] = (char*)slab->alloc(40);
+            memset(blocks[k], fill, 40);
+        }
+        for (int k = 0; k < N; k++) {
+            char first = blocks[k][0];
+            char last = blocks[k][39];
+            ASSERT(first == fill && last == fill, "Block shared", k);
+            slab->free(blocks[k]);
+        }
+    }
+}
+
+void test_slab_many_threads(int nth, int nit) {
+    SlabAlloc<4> slab;
+    std::vector<std::thread> T;
+    for (int i = 0; i < nth; i++) {
+        T.emplace_back(slab_churn_thread, &slab, (char)(0xd0 + i), nit);
+    }
+    for (auto &t : T) {
+        t.join();
+    }
+}
+
+void test_slab_pmr() {
+    Slab slab;
+    std::pmr::map<int, std::pmr::string> m(slab.resource());
+    for (int i = 0; i < 10000; i++) {
+        m.emplace(i, std::to_string(i) + " some padding past sso");
+    }
+    std::string s(m[77]);
+    ASSERT(s == "77 some padding past sso", "Wrong value", s);
+    m.clear();
+}
+
+// random sizes, keeps `live` blocks around
+template<bool with_slab>
+void test_many_small(int nit, int live) {
+    auto &slab = default_slab();
+    std::minstd_rand rng(42);
+    std::vector<void*> blocks(live, nullptr);
+    for (int i = 0; i < nit; i++) {
+        auto k = rng() % live;
+        size_t n = 8 + rng() % 256;
+        if (with_slab) {
+            slab.free(blocks[k]);
+            blocks[k] = slab.alloc(n);
+        } else {
+            free(blocks[k]);
+            blocks[k] = malloc(n);
+        }
+        *(char*)blocks[k] = 1;
+    }
+    for (auto *p : blocks) {
+        if (with_slab) {
+            slab.free(p);
+        } else {
+            free(p);
+        }
+    }
+}
+
+// node based container churn
+template<bool with_slab>
+void test_many_nodes(int nit, int n) {
+    std::pmr::memory_resource *res = with_slab
+        ? default_slab().resource() : std::pmr::new_delete_resource();
+    for (int it = 0; it < nit; it++) {
+        std::pmr::list<int> l(res);
+        for (int i = 0; i < n; i++) {
+            l.push_back(i);
+        }
+    }
+}
+
+int test() {
+    TEST(test_size_class).run();
+    TEST(test_slab_alloc).run();
+    TEST(test_slab_cross_thread).run();
+    TEST(test_slab_pmr).run();
+    TEST(test_slab_many_threads).run(8, 1e6);
+    TEST(test_many_small<false>).benchmark(10, 1e7, 10000);
+    TEST(test_many_small<true>).benchmark(10, 1e7, 10000);
+    TEST(test_many_nodes<false>).benchmark(10, 1000, 10000);
+    TEST(test_many_nodes<true>).benchmark(10, 1000, 10000);
+    return 0;
+}